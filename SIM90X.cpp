@@ -30,6 +30,16 @@
 
 #include "SIM90X.h"
 
+// Update a CRC-32 (IEEE 802.3, reflected) register with len bytes.
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint16_t len) {
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t k=0; k<8; k++)
+      crc = (crc >> 1) ^ (0xEDB88320UL & (0 - (crc & 1)));
+  }
+  return crc;
+}
+
 SIM90X::SIM90X(int8_t rst)
 {
   _rstpin = rst;
@@ -38,24 +48,85 @@ SIM90X::SIM90X(int8_t rst)
   apnusername = 0;
   apnpassword = 0;
   mySerial = 0;
+  lasttx = 0;
+  txlen = 0;
+  txbytes = 0;
+  txwrites = 0;
+  lasterror = SIM90X_ERROR_NONE;
+  lasterrorcode = 0;
+  pending = true;
+  memset(latency, 0, sizeof(latency));
+  timedcmd = SIM90X_CMD_NONE;
+  timedstart = 0;
+  urccallback = 0;
+  urcctx = 0;
+#if SIM90X_ENABLE_TCP
+  transparent = false;
+  closedidx = 0;
+  tcprxmode = SIM90X_TCP_RXGET;
+  tcprxhead = tcprxtail = 0;
+  tcprxdropped = 0;
+#endif
+#if SIM90X_ENABLE_TIME
+  timeset = false;
+  timeutc = 0;
+  timems = 0;
+  timetz = 0;
+  timedrift = 0;
+  timedriftutc = 0;
+  timedriftms = 0;
+  timeresync = SIM90X_TIME_RESYNC_MS;
+  timefailed = false;
+  timetried = 0;
+#endif
+#if SIM90X_ENABLE_AUDIO
+  tonehead = tonecount = 0;
+  tonestart = 0;
+  tonelen = 0;
+#endif
+#if SIM90X_ENABLE_CALL
+  _incomingCall = false;
+  callstate = SIM90X_CALL_IDLE;
+  callnumber[0] = 0;
+  callchanged = false;
+  callreported = false;
+  callseen = false;
+  callcallback = 0;
+#endif
+#if SIM90X_ENABLE_SMS
+  smscallback = 0;
+  smshead = smscount = 0;
+  smsdropped = 0;
+  smsdelivering = false;
+  smsstoredcount = 0;
+  smsref = 0;
+  smstext = false;
+#endif
+#if SIM90X_ENABLE_HTTP
   httpsredirect = false;
   useragent = F("SIM90X");
+  httpcache = 0;
+  httpcachesize = 0;
+  httpcachenext = 0;
+#endif
 }
 
-boolean SIM90X::begin(Stream &port) {
+boolean SIM90X::begin(SIM90X_serial_t &port) {
   mySerial = &port;
 
-  pinMode(_rstpin, OUTPUT);
-  digitalWrite(_rstpin, HIGH);
-  delay(10);
-  digitalWrite(_rstpin, LOW);
-  delay(100);
-  digitalWrite(_rstpin, HIGH);
+  if (_rstpin >= 0) {
+    pinMode(_rstpin, OUTPUT);
+    digitalWrite(_rstpin, HIGH);
+    delay(10);
+    digitalWrite(_rstpin, LOW);
+    delay(100);
+    digitalWrite(_rstpin, HIGH);
 
-  // give 3 seconds to reboot
-  delay(3000);
+    // give 3 seconds to reboot
+    delay(3000);
+  }
 
-  while (mySerial->available()) mySerial->read();
+  while (mySerial->SIM90X_SERIAL(available)()) mySerial->SIM90X_SERIAL(read)();
 
   sendCheckReply(F("AT"), F("OK"));
   delay(100);
@@ -72,28 +143,76 @@ boolean SIM90X::begin(Stream &port) {
     return false;
   }
 
+  // report failures as +CME ERROR: <n> instead of a bare ERROR
+  sendCheckReply(F("AT+CMEE=1"), F("OK"));
+#if SIM90X_ENABLE_SMS
+  smstext = false;
+#endif
+
   return true;
 }
 
+// Process any unsolicited data waiting on the serial port (pushed TCP
+// data, ...). Call it from loop() when the modem is otherwise idle.
+void SIM90X::poll(void) {
+#if SIM90X_ENABLE_CALL
+  boolean ring = _incomingCall || _incomingCallShared;
+  _incomingCall = false;
+  _incomingCallShared = false;
+  // the RI line fell before the URCs got here
+  if (ring && ! dataMode() && ! mySerial->SIM90X_SERIAL(available)())
+    readline(SIM90X_RING_WAIT_MS);
+#endif
+  // in data mode the bytes waiting are the sketch's socket data
+  while (! dataMode() && mySerial->SIM90X_SERIAL(available)()) {
+    readline(20);  // don't linger once the pending data is consumed
+  }
+#if SIM90X_ENABLE_SMS
+  smsDeliver();
+#endif
+#if SIM90X_ENABLE_CALL
+  if (callchanged) {
+    callchanged = false;
+    if (callcallback) callcallback(callstate, callnumber);
+  }
+#endif
+#if SIM90X_ENABLE_AUDIO
+  toneNext();
+#endif
+}
+
+#if SIM90X_ENABLE_TIME
 
 /********* Real Time Clock ********************************************/
 
 boolean SIM90X::readRTC(uint8_t *year, uint8_t *month, uint8_t *date, uint8_t *hr, uint8_t *min, uint8_t *sec) {
-  uint16_t v;
-  sendParseReply(F("AT+CCLK?"), F("+CCLK: "), &v, '/', 0);
-  *year = v;
+  SIM90X_time_t t;
+
+  if (! getTime(&t))
+    return false;
+
+  *year = t.year;
+  *month = t.month;
+  *date = t.day;
+  *hr = t.hour;
+  *min = t.minute;
+  *sec = t.second;
 
 #ifdef SIM90X_DEBUG
   Serial.println(*year);
 #endif
+  return true;
 }
 
 boolean SIM90X::enableRTC(uint8_t i) {
+  // the modem clock may be set differently now, read it again
+  timeset = false;
   if (! sendCheckReply(F("AT+CLTS="), i, F("OK"))) 
     return false;
   return sendCheckReply(F("AT&W"), F("OK"));
 }
 
+#endif
 
 /********* BATTERY & ADC ********************************************/
 
@@ -131,7 +250,7 @@ uint8_t SIM90X::getSIMCCID(char *ccid) {
   strncpy(ccid, replybuffer, 20);
   ccid[20] = 0;
 
-  readline(); // eat 'OK'
+  waitFinal(); // eat 'OK'
 
   return strlen(ccid);
 }
@@ -145,7 +264,7 @@ uint8_t SIM90X::getIMEI(char *imei) {
   strncpy(imei, replybuffer, 15);
   imei[15] = 0;
 
-  readline(); // eat 'OK'
+  waitFinal(); // eat 'OK'
 
   return strlen(imei);
 }
@@ -169,6 +288,40 @@ uint8_t SIM90X::getRSSI(void) {
   return reply;
 }
 
+// Sample signal, registration, battery and GPRS attach state with one
+// concatenated command instead of a round trip for each of them.
+boolean SIM90X::getHealth(SIM90X_health_t *health) {
+  uint16_t v;
+  uint8_t found = 0;
+
+  getReply(F("AT+CSQ;+CREG?;+CBC;+CGATT?"));
+
+  // the replies come one per line, followed by a single OK
+  while (replybuffer[0]) {
+    if (parseReply(F("+CSQ: "), &v)) {
+      health->rssi = v;
+      found |= 0x01;
+    } else if (parseReply(F("+CREG: "), &v, ',', 1)) {
+      health->netstatus = v;
+      found |= 0x02;
+    } else if (parseReply(F("+CBC: "), &v, ',', 1)) {
+      health->battpercent = v;
+      parseReply(F("+CBC: "), &health->battvoltage, ',', 2);
+      found |= 0x04;
+    } else if (parseReply(F("+CGATT: "), &v)) {
+      health->gprs = v;
+      found |= 0x08;
+    } else if (finalResult()) {
+      break;
+    }
+    readline();
+  }
+
+  return (lasterror == SIM90X_ERROR_NONE) && (found == 0x0F);
+}
+
+#if SIM90X_ENABLE_AUDIO
+
 /********* AUDIO *******************************************************/
 
 boolean SIM90X::setAudio(uint8_t a) {
@@ -204,6 +357,100 @@ boolean SIM90X::playToolkitTone(uint8_t t, uint16_t len) {
   return sendCheckReply(F("AT+STTONE=1,"), t, len, F("OK"));
 }
 
+/********* TONE SEQUENCES *************************************************/
+
+// Number of digits in a DTMF string, 0 if it is too long or one of them
+// isn't a DTMF digit.
+static uint8_t DTMFdigits(const char *digits) {
+  uint8_t n = 0;
+
+  for (; *digits; digits++, n++) {
+    char c = *digits;
+    if (n == SIM90X_DTMF_MAX) return 0;
+    if (! isdigit(c) && c != '*' && c != '#' && (c < 'A' || c > 'D')) return 0;
+  }
+  return n;
+}
+
+// Write digits as the quoted, comma separated DTMF string of AT+VTS and
+// AT+CLDTMF.
+void SIM90X::txDTMF(const char *digits) {
+  txPut('"');
+  for (uint8_t i=0; digits[i]; i++) {
+    if (i) txPut(',');
+    txPut(digits[i]);
+  }
+  txPut('"');
+}
+
+// Play a whole digit string locally with one command, duration per digit
+// in 1/10 s.
+boolean SIM90X::playDTMF(const char *digits, uint8_t duration) {
+  uint8_t n = DTMFdigits(digits);
+
+  if (! n) return false;
+
+  flushInput();
+  txPrint(F("AT+CLDTMF="));
+  txPrint(duration);
+  txPut(',');
+  txDTMF(digits);
+  txPrintln();
+  return waitFinal(SIM90X_DEFAULT_TIMEOUT_MS + n * duration * 100UL);
+}
+
+// Send a digit string to the remote party of the call in one command.
+// A duration of 0 keeps the one set by AT+VTD.
+boolean SIM90X::sendDTMF(const char *digits, uint8_t duration) {
+  uint8_t n = DTMFdigits(digits);
+
+  if (! n) return false;
+
+  flushInput();
+  txPrint(F("AT+VTS="));
+  txDTMF(digits);
+  if (duration) {
+    txPut(',');
+    txPrint(duration);
+  }
+  txPrintln();
+  return waitFinal(SIM90X_DEFAULT_TIMEOUT_MS + n * max(duration, (uint8_t)3) * 100UL);
+}
+
+// Tones wait here and are started back to back from poll(), so the
+// sketch doesn't block while a sequence plays.
+boolean SIM90X::queueTone(uint8_t tone, uint16_t len) {
+  if (tonecount == SIM90X_TONE_QUEUE) return false;
+
+  uint8_t i = (tonehead + tonecount++) % SIM90X_TONE_QUEUE;
+  tonequeue[i].tone = tone;
+  tonequeue[i].len = len;
+  return true;
+}
+
+void SIM90X::clearTones(void) {
+  tonecount = 0;
+  tonelen = 0;
+}
+
+uint8_t SIM90X::queuedTones(void) {
+  return tonecount;
+}
+
+void SIM90X::toneNext(void) {
+  if (! tonecount || millis() - tonestart < tonelen) return;
+
+  uint8_t tone = tonequeue[tonehead].tone;
+  tonelen = tonequeue[tonehead].len;
+  tonehead = (tonehead + 1) % SIM90X_TONE_QUEUE;
+  tonecount--;
+
+  // start the next one when this one is due to end, not after the reply
+  tonestart = millis();
+  if (tone)
+    playToolkitTone(tone, tonelen);
+}
+
 boolean SIM90X::setMicVolume(uint8_t a, uint8_t level) {
   // 0 is headset, 1 is external audio
   if (a > 1) return false;
@@ -211,6 +458,10 @@ boolean SIM90X::setMicVolume(uint8_t a, uint8_t level) {
   return sendCheckReply(F("AT+CMIC="), a, level, F("OK"));
 }
 
+#endif
+
+#if SIM90X_ENABLE_FM
+
 /********* FM RADIO *******************************************************/
 
 
@@ -269,10 +520,106 @@ int8_t SIM90X::getFMSignalLevel(uint16_t station) {
   p+=1;
   // Parse signal quality.
   int8_t level = atoi(p);
-  readline();  // eat the "OK"
+  waitFinal();  // eat the "OK"
   return level;
 }
 
+/********* FM BAND SCAN ***************************************************/
+
+// Keep stations sorted by level, strongest first, dropping the weakest
+// once max are kept.
+static void FMinsert(SIM90X_fmstation_t *stations, uint8_t *n, uint8_t max,
+                     uint16_t station, int8_t level) {
+  uint8_t i = *n;
+
+  if (i == max) {
+    if (! max || level <= stations[max-1].level) return;
+    i--;
+  } else {
+    (*n)++;
+  }
+  for (; i > 0 && stations[i-1].level < level; i--)
+    stations[i] = stations[i-1];
+  stations[i].station = station;
+  stations[i].level = level;
+}
+
+// Measure a batch of stations with one concatenated command line
+// (AT+FMSIGNAL=<f1>;+FMSIGNAL=<f2>;...) instead of a round trip each.
+void SIM90X::FMsignals(const uint16_t *freqs, uint8_t count,
+                       SIM90X_fmstation_t *stations, uint8_t *n, uint8_t max,
+                       int8_t minlevel) {
+  flushInput();
+  txPrint(F("AT"));
+  for (uint8_t i=0; i<count; i++) {
+    if (i) txPut(';');
+    txPrint(F("+FMSIGNAL="));
+    txPrint(freqs[i]);
+  }
+  txPrintln();
+
+  // "+FMSIGNAL: freq[<station>]:<level>" for each, then a single OK
+  while (readline(1000)) {
+    if (finalResult()) break;
+
+    char *p = strstr_P(replybuffer, PSTR("+FMSIGNAL: "));
+    if (p == 0) continue;
+    p += 11;
+    while (*p && ! isdigit(*p)) p++;
+    uint16_t station = atoi(p);
+    p = strchr(p, ':');
+    if (p == 0) continue;
+    int8_t level = atoi(p+1);
+
+    if (level >= minlevel)
+      FMinsert(stations, n, max, station, level);
+  }
+}
+
+// Find the stations of the band, strongest first. AT+FMSCAN finds them
+// and only those are measured. Without it the whole band is measured in
+// batches. Returns how many of the max stations were filled in.
+uint8_t SIM90X::scanFMBand(SIM90X_fmstation_t *stations, uint8_t max, int8_t minlevel) {
+  uint16_t freqs[SIM90X_FM_SCAN_MAX];
+  uint8_t nfreqs = 0;
+  uint8_t n = 0;
+
+  // one station per line, then OK
+  getReply(F("AT+FMSCAN"), SIM90X_FM_SCAN_TIMEOUT_MS);
+  while (isdigit(replybuffer[0])) {
+    if (nfreqs < SIM90X_FM_SCAN_MAX)
+      freqs[nfreqs++] = atoi(replybuffer);
+    readline(SIM90X_FM_SCAN_TIMEOUT_MS);
+  }
+
+  if (strcmp_P(replybuffer, PSTR("OK")) == 0) {
+    for (uint8_t i=0; i<nfreqs; i+=SIM90X_FM_BATCH)
+      FMsignals(freqs+i, min(SIM90X_FM_BATCH, nfreqs-i), stations, &n, max, minlevel);
+    return n;
+  }
+  waitFinal();
+
+  for (uint16_t f=875; f<=1080; f+=SIM90X_FM_BATCH) {
+    uint8_t k;
+    for (k=0; k<SIM90X_FM_BATCH && f+k<=1080; k++)
+      freqs[k] = f+k;
+    FMsignals(freqs, k, stations, &n, max, minlevel);
+  }
+  return n;
+}
+
+boolean SIM90X::tuneFMStrongest(void) {
+  SIM90X_fmstation_t best;
+
+  if (! scanFMBand(&best, 1))
+    return false;
+  return tuneFMradio(best.station);
+}
+
+#endif
+
+#if SIM90X_ENABLE_PWM
+
 /********* PWM/BUZZER **************************************************/
 
 boolean SIM90X::setPWM(uint16_t period, uint8_t duty) {
@@ -282,69 +629,204 @@ boolean SIM90X::setPWM(uint16_t period, uint8_t duty) {
   return sendCheckReply(F("AT+SPWM=0,"), period, duty, F("OK"));
 }
 
+#endif
+
+#if SIM90X_ENABLE_CALL
+
 /********* CALL PHONES **************************************************/
 boolean SIM90X::callPhone(char *number) {
-  char sendbuff[35] = "ATD";
-  strncpy(sendbuff+3, number, min(30, strlen(number)));
-  uint8_t x = strlen(sendbuff);
+  char sendbuff[SIM90X_SENDBUFFER_SIZE] = "ATD";
+  strncpy(sendbuff+3, number, min(SIM90X_SENDBUFFER_SIZE-5, strlen(number)));
+  uint16_t x = strlen(sendbuff);
   sendbuff[x] = ';';
   sendbuff[x+1] = 0;
   //Serial.println(sendbuff);
 
-  return sendCheckReply(sendbuff, "OK");
+  if (! sendCheckReply(sendbuff, "OK"))
+    return false;
+
+  strncpy(callnumber, number, sizeof(callnumber)-1);
+  callnumber[sizeof(callnumber)-1] = 0;
+  setCallState(SIM90X_CALL_DIALING);
+  return true;
 }
 
 boolean SIM90X::hangUp(void) {
-  return sendCheckReply(F("ATH0"), F("OK"));
+  if (! sendCheckReply(F("ATH0"), F("OK")))
+    return false;
+
+  if (callstate != SIM90X_CALL_IDLE) setCallState(SIM90X_CALL_ENDED);
+  return true;
 }
 
 boolean SIM90X::pickUp(void) {
-  return sendCheckReply(F("ATA"), F("OK"));
-}
+  if (! sendCheckReply(F("ATA"), F("OK")))
+    return false;
 
-void SIM90X::onIncomingCall() {
-  #ifdef SIM90X_DEBUG
-  Serial.print(F("> ")); Serial.println(F("Incoming call..."));
-  #endif
-  SIM90X::_incomingCall = true;
+  setCallState(SIM90X_CALL_ACTIVE);
+  return true;
 }
 
-boolean SIM90X::_incomingCall = false;
+SIM90X *SIM90X::_callirq[SIM90X_CALL_INTERRUPTS];
+uint8_t SIM90X::_callirqnum[SIM90X_CALL_INTERRUPTS];
+volatile boolean SIM90X::_incomingCallShared = false;
 
 boolean SIM90X::callerIdNotification(boolean enable, uint8_t interrupt) {
+  static void (* const isr[SIM90X_CALL_INTERRUPTS])(void) = {
+    onIncomingCall<0>, onIncomingCall<1>, onIncomingCall<2>, onIncomingCall<3>
+  };
+  int8_t slot = -1;
+
+  // the slot this interrupt already has, else a free one
+  for (uint8_t i=0; i<SIM90X_CALL_INTERRUPTS; i++) {
+    if (_callirq[i] == this && _callirqnum[i] == interrupt) {
+      slot = i;
+      break;
+    }
+    if (! _callirq[i] && slot < 0 && enable)
+      slot = i;
+  }
+
   if(enable){
-    attachInterrupt(interrupt, onIncomingCall, FALLING);
+    if (slot >= 0) {
+      _callirq[slot] = this;
+      _callirqnum[slot] = interrupt;
+      attachInterrupt(interrupt, isr[slot], FALLING);
+    } else {
+      attachInterrupt(interrupt, onIncomingCallShared, FALLING);
+    }
     return sendCheckReply(F("AT+CLIP=1"), F("OK"));
   }
 
   detachInterrupt(interrupt);
+  if (slot >= 0)
+    _callirq[slot] = 0;
   return sendCheckReply(F("AT+CLIP=0"), F("OK"));
 }
 
+// Copy the number of a ringing call, once per call. RING and +CLIP are
+// picked up by poll() as they arrive, so this never waits for them.
 boolean SIM90X::incomingCallNumber(char* phonenum) {
   //+CLIP: "<incoming phone number>",145,"",0,"",0
-  if(!SIM90X::_incomingCall)
-    return false;
-
-  readline();
-  while(!strcmp_P(replybuffer, (prog_char*)F("RING")) == 0) {
-    flushInput();
-    readline();
-  }
-
-  readline(); //reads incoming phone number line
+  poll();
 
-  parseReply(F("+CLIP: \""), phonenum, '"');
+  if (callstate != SIM90X_CALL_RINGING || ! callnumber[0] || callreported)
+    return false;
 
+  strcpy(phonenum, callnumber);
   #ifdef SIM90X_DEBUG
     Serial.print(F("Phone Number: "));
-    Serial.println(replybuffer);
+    Serial.println(phonenum);
   #endif
 
-  SIM90X::_incomingCall = false;
+  callreported = true;
   return true;
 }
 
+/********* CALL STATE ***************************************************/
+
+// Report call state changes to callback from poll(). Also turns on caller
+// id (+CLIP) and call list reports (+CLCC) on every change.
+boolean SIM90X::setCallCallback(SIM90X_callcallback callback) {
+  callcallback = callback;
+
+  if (! sendCheckReply(F("AT+CLIP=1"), F("OK"))) return false;
+  return sendCheckReply(F("AT+CLCC=1"), F("OK"));
+}
+
+uint8_t SIM90X::getCallState(void) {
+  return callstate;
+}
+
+// Ask the modem for the current calls (AT+CLCC) instead of waiting for
+// the next event. No call listed ends the one we knew of.
+uint8_t SIM90X::queryCallState(void) {
+  callseen = false;
+  if (sendCheckReply(F("AT+CLCC"), F("OK")) && ! callseen &&
+      callstate != SIM90X_CALL_IDLE && callstate != SIM90X_CALL_ENDED)
+    setCallState(SIM90X_CALL_ENDED);
+
+  return callstate;
+}
+
+void SIM90X::setCallState(uint8_t state) {
+  if (state == callstate) return;
+
+  if (state == SIM90X_CALL_RINGING || state == SIM90X_CALL_IDLE) {
+    callnumber[0] = 0;
+    callreported = false;
+  }
+  callstate = state;
+  callchanged = true;
+}
+
+// Track the call from RING, +CLIP, +COLP, +CLCC and the result codes that
+// end it. True if replybuffer held one of them.
+boolean SIM90X::callURC(void) {
+  uint16_t stat;
+
+  if (strcmp_P(replybuffer, PSTR("RING")) == 0) {
+    if (callstate != SIM90X_CALL_RINGING) setCallState(SIM90X_CALL_RINGING);
+    return true;
+  }
+
+  if (strncmp_P(replybuffer, PSTR("+CLIP: "), 7) == 0) {
+    if (callstate != SIM90X_CALL_RINGING) setCallState(SIM90X_CALL_RINGING);
+    if (! callnumber[0]) {
+      parseReplyQuoted(F("+CLIP: "), callnumber, sizeof(callnumber)-1, ',', 0);
+      callnumber[sizeof(callnumber)-1] = 0;
+      callchanged = true;  // the caller id is known now
+    }
+    return true;
+  }
+
+  if (strncmp_P(replybuffer, PSTR("+COLP: "), 7) == 0) {
+    setCallState(SIM90X_CALL_ACTIVE);
+    return true;
+  }
+
+  // +CLCC: <id>,<dir>,<stat>,<mode>,<mpty>[,<number>,<type>]
+  if (parseReply(F("+CLCC: "), &stat, ',', 2)) {
+    static const uint8_t states[] PROGMEM = {
+      SIM90X_CALL_ACTIVE, SIM90X_CALL_ACTIVE,    // active, held
+      SIM90X_CALL_DIALING, SIM90X_CALL_DIALING,  // dialing, alerting
+      SIM90X_CALL_RINGING, SIM90X_CALL_RINGING,  // incoming, waiting
+      SIM90X_CALL_ENDED,                         // disconnected
+    };
+    char number[sizeof(callnumber)];
+
+    callseen = true;
+    if (stat > 6) return true;
+    number[0] = 0;
+    parseReplyQuoted(F("+CLCC: "), number, sizeof(number)-1, ',', 5);
+    number[sizeof(number)-1] = 0;
+
+    setCallState(pgm_read_byte(&states[stat]));
+    if (number[0] && strcmp(number, callnumber) != 0) {
+      strcpy(callnumber, number);
+      callchanged = true;
+    }
+    return true;
+  }
+
+  // a call in progress ends with one of these instead of a reply
+  if (callstate == SIM90X_CALL_IDLE || callstate == SIM90X_CALL_ENDED)
+    return false;
+  if (strcmp_P(replybuffer, PSTR("NO CARRIER")) == 0 ||
+      strcmp_P(replybuffer, PSTR("BUSY")) == 0 ||
+      strcmp_P(replybuffer, PSTR("NO ANSWER")) == 0 ||
+      strcmp_P(replybuffer, PSTR("NO DIALTONE")) == 0) {
+    setCallState(SIM90X_CALL_ENDED);
+    return true;
+  }
+
+  return false;
+}
+
+#endif
+
+#if SIM90X_ENABLE_SMS
+
 /********* SMS **********************************************************/
 
 uint8_t SIM90X::getSMSInterrupt(void) {
@@ -362,7 +844,7 @@ boolean SIM90X::setSMSInterrupt(uint8_t i) {
 int8_t SIM90X::getNumSMS(void) {
   uint16_t numsms;
 
-  if (! sendCheckReply(F("AT+CMGF=1"), F("OK"))) return -1;
+  if (! smsTextMode()) return -1;
   // ask how many sms are stored
 
   if (! sendParseReply(F("AT+CPMS?"), F("+CPMS: \"SM_P\","), &numsms) ) return -1;
@@ -375,7 +857,7 @@ int8_t SIM90X::getNumSMS(void) {
 boolean SIM90X::readSMS(uint8_t i, char *smsbuff, 
 			       uint16_t maxlen, uint16_t *readlen) {
   // text mode
-  if (! sendCheckReply(F("AT+CMGF=1"), F("OK"))) return false;
+  if (! smsTextMode()) return false;
 
   // show all text mode parameters
   if (! sendCheckReply(F("AT+CSDH=1"), F("OK"))) return false;
@@ -384,9 +866,10 @@ boolean SIM90X::readSMS(uint8_t i, char *smsbuff,
   uint16_t thesmslen = 0;
 
   //getReply(F("AT+CMGR="), i, 1000);  //  do not print debug!
-  mySerial->print(F("AT+CMGR="));
-  mySerial->println(i);
-  readline(1000); // timeout
+  txPrint(F("AT+CMGR="));
+  txPrint(i);
+  txPrintln();
+  readline(timeoutFor(SIM90X_CMD_SMSREAD));
 
   //Serial.print(F("Reply: ")); Serial.println(replybuffer);
   // parse it out...
@@ -397,8 +880,6 @@ boolean SIM90X::readSMS(uint8_t i, char *smsbuff,
 
   readRaw(thesmslen);
 
-  flushInput();
-
   uint16_t thelen = min(maxlen, strlen(replybuffer));
   strncpy(smsbuff, replybuffer, thelen);
   smsbuff[thelen] = 0; // end the string
@@ -407,6 +888,8 @@ boolean SIM90X::readSMS(uint8_t i, char *smsbuff,
   Serial.println(replybuffer);
 #endif
   *readlen = thelen;
+
+  waitFinal(); // eat 'OK'
   return true;
 }
 
@@ -417,41 +900,52 @@ boolean SIM90X::readSMS(uint8_t i, char *smsbuff,
 // otherwise false.
 boolean SIM90X::getSMSSender(uint8_t i, char *sender, int senderlen) {
   // Ensure text mode and all text mode parameters are sent.
-  if (! sendCheckReply(F("AT+CMGF=1"), F("OK"))) return false;
+  if (! smsTextMode()) return false;
   if (! sendCheckReply(F("AT+CSDH=1"), F("OK"))) return false;
   // Send command to retrieve SMS message and parse a line of response.
-  mySerial->print(F("AT+CMGR="));
-  mySerial->println(i);
-  readline(1000);
+  txPrint(F("AT+CMGR="));
+  txPrint(i);
+  txPrintln();
+  readline(timeoutFor(SIM90X_CMD_SMSREAD));
   // Parse the second field in the response.
   boolean result = parseReplyQuoted(F("+CMGR:"), sender, senderlen, ',', 1);
   // Drop any remaining data from the response.
-  flushInput();
+  waitFinal();
   return result;
 }
 
 boolean SIM90X::sendSMS(char *smsaddr, char *smsmsg) {
-  if (! sendCheckReply("AT+CMGF=1", "OK")) return -1;
+  uint8_t mr;
+  return sendSMS(smsaddr, smsmsg, &mr);
+}
+
+// Send a text message and get its message reference from +CMGS.
+boolean SIM90X::sendSMS(char *smsaddr, char *smsmsg, uint8_t *mr) {
+  if (! smsTextMode()) return false;
 
-  char sendcmd[30] = "AT+CMGS=\"";
-  strncpy(sendcmd+9, smsaddr, 30-9-2);  // 9 bytes beginning, 2 bytes for close quote + null
+  char sendcmd[SIM90X_SENDBUFFER_SIZE] = "AT+CMGS=\"";
+  strncpy(sendcmd+9, smsaddr, SIM90X_SENDBUFFER_SIZE-9-2);  // 9 bytes beginning, 2 bytes for close quote + null
   sendcmd[strlen(sendcmd)] = '\"';
 
-  if (! sendCheckReply(sendcmd, "> ")) return false;
+  flushInput();
+  txPrint(sendcmd);
+  txPrintln();
+  if (! waitPrompt()) return false;
 #ifdef SIM90X_DEBUG
   Serial.print(F("> ")); Serial.println(smsmsg);
 #endif
-  mySerial->println(smsmsg);
-  mySerial->println();
-  mySerial->write(0x1A);
+  txPrint(smsmsg);
+  txPrint(F("\r\n\r\n\x1A"));
+  txFlush();
 #ifdef SIM90X_DEBUG
   Serial.println("^Z");
 #endif
-  readline(10000); // read the +CMGS reply, wait up to 10 seconds!!!
+  readline(timeoutFor(SIM90X_CMD_SMSSEND)); // read the +CMGS reply
   //Serial.print("* "); Serial.println(replybuffer);
   if (strstr(replybuffer, "+CMGS") == 0) {
     return false;
   }
+  *mr = atoi(replybuffer+7);
   readline(1000); // read OK
   //Serial.print("* "); Serial.println(replybuffer);
 
@@ -462,9 +956,22 @@ boolean SIM90X::sendSMS(char *smsaddr, char *smsmsg) {
   return true;
 }
 
+// Switch to SMS text mode unless it is known to be on already.
+boolean SIM90X::smsTextMode(void) {
+  if (! smstext)
+    smstext = sendCheckReply(F("AT+CMGF=1"), F("OK"));
+  return smstext;
+}
+
+// Keep the relay link open between messages (AT+CMMS): 0 off, 1 until
+// 1-5 s pass without a new message, 2 always.
+boolean SIM90X::setSMSLinkHold(uint8_t mode) {
+  return sendCheckReply(F("AT+CMMS="), mode, F("OK"));
+}
+
 
 boolean SIM90X::deleteSMS(uint8_t i) {
-    if (! sendCheckReply("AT+CMGF=1", "OK")) return -1;
+    if (! smsTextMode()) return -1;
   // read an sms
   char sendbuff[12] = "AT+CMGD=000";
   sendbuff[8] = (i / 100) + '0';
@@ -477,7 +984,7 @@ boolean SIM90X::deleteSMS(uint8_t i) {
 }
 
 boolean SIM90X::deleteSMSs(uint8_t type){
-  if (!sendCheckReply("AT+CMGF=1", "OK")) return -1;
+  if (!smsTextMode()) return -1;
   
   char t[14];
   char buffer[22];
@@ -512,18 +1019,19 @@ uint8_t SIM90X::hasSMS(uint8_t type){
   uint8_t i = 0;
   boolean status;
 
-  mySerial->print(F("AT+CMGL="));
+  txPrint(F("AT+CMGL="));
   switch(type){
     case SIM90X_SMS_ALL:
-      mySerial->println(F("\"ALL\""));
+      txPrint(F("\"ALL\""));
       break;
     case SIM90X_SMS_UNREAD:
-      mySerial->println(F("\"REC UNREAD\""));
+      txPrint(F("\"REC UNREAD\""));
       break;
     case SIM90X_SMS_READ:
-      mySerial->println(F("\"REC READ\""));
+      txPrint(F("\"REC READ\""));
       break;
   }
+  txPrintln();
 
   readline();
   if(parseReplyQuoted(F("+CMGL:"), replybuffer, 8, ',', 0)){
@@ -531,141 +1039,634 @@ uint8_t SIM90X::hasSMS(uint8_t type){
   }
 
   // Drop any remaining data from the response.
-  flushInput();
+  waitFinal();
   return i;
 }
 
-/********* PHONEBOOK ****************************************************/
+/********* SMS PDU MODE *************************************************/
 
-boolean SIM90X::getPhonebook(uint8_t addr, char *number, int number_length, char *name, int name_length) {
-  boolean status;
-  // Send command to retrieve PHONEBOOK item and parse a line of response.
-  mySerial->print(F("AT+CPBR="));
-  mySerial->println(addr);
-  readline();
-  // Parse the second field in the response.
-  if((status = parseReplyQuoted(F("+CPBR:"), number, number_length, ',', 1))){
-    parseReplyQuoted(F("+CPBR:"), name, name_length, ',', 3);
+// Send a payload of any length in PDU mode. GSM 7-bit text (dcs
+// SIM90X_PDU_GSM7) is given as Latin-1, UCS2 as UTF-16BE.
+boolean SIM90X::sendSMS(char *smsaddr, const uint8_t *data, uint16_t len, uint8_t dcs) {
+  uint8_t tpdu[SIM90X_PDU_MAX_TPDU];
+  uint8_t total = SIM90XPDU::parts(data, len, dcs);
+  boolean ok = true;
+
+  smstext = false;
+  if (! sendCheckReply(F("AT+CMGF=0"), F("OK"))) return false;
+
+  smsref++;
+  for (uint8_t part=1; ok && part<=total; part++) {
+    uint8_t n = SIM90XPDU::submit(tpdu, smsaddr, data, len, dcs, smsref, part);
+    ok = n && sendPDU(tpdu, n);
   }
 
-  // Drop any remaining data from the response.
-  flushInput();
-  return status;
+  // the other SMS functions expect text mode
+  smsTextMode();
+  return ok;
 }
 
-boolean SIM90X::getPhonebookNumber(uint8_t i, char *number, int length) {
-  // Send command to retrieve PHONEBOOK item and parse a line of response.
-  mySerial->print(F("AT+CPBR="));
-  mySerial->println(i);
-  readline(1000);
-  // Parse the second field in the response.
-  boolean result = parseReplyQuoted(F("+CPBR:"), number, length, ',', 1);
-  // Drop any remaining data from the response.
-  flushInput();
-  return result;
-}
+boolean SIM90X::sendPDU(const uint8_t *tpdu, uint8_t len) {
+  static const char hex[] PROGMEM = "0123456789ABCDEF";
 
-boolean SIM90X::getPhonebookName(uint8_t i, char *name, int length) {
-  // Send command to retrieve PHONEBOOK item and parse a line of response.
-  mySerial->print(F("AT+CPBR="));
-  mySerial->println(i);
-  readline(1000);
-  // Parse the second field in the response.
-  boolean result = parseReplyQuoted(F("+CPBR:"), name, length, ',', 3);
-  // Drop any remaining data from the response.
   flushInput();
-  return result;
-}
+  txPrint(F("AT+CMGS="));
+  txPrint(len);
+  txPrintln();
+  if (! waitPrompt()) return false;
+
+  // no SMSC address, the one set with AT+CSCA is used
+  txPrint(F("00"));
+  for (uint8_t i=0; i<len; i++) {
+    txPut(pgm_read_byte(&hex[tpdu[i] >> 4]));
+    txPut(pgm_read_byte(&hex[tpdu[i] & 0x0F]));
+  }
+  txPut(0x1A);
+  txFlush();
 
-uint8_t SIM90X::hasPhonebookNumber(char *number) {
-  uint8_t addr = 0;
-  for(uint8_t i = 0; i < 20; i++){
-    char buffer[24];
+  readline(timeoutFor(SIM90X_CMD_SMSSEND)); // read the +CMGS reply
+  if (strncmp_P(replybuffer, PSTR("+CMGS"), 5) != 0)
+    return false;
 
-    mySerial->print(F("AT+CPBR="));
-    mySerial->println(i + 1);
-    readline(1000);
-    if(parseReplyQuoted(F("+CPBR:"), buffer, 24, ',', 1)){
-      if(strcmp(number, buffer) == 0) return (i + 1);
-    }
-    flushInput();
-  }
-  
-  return addr;
+  return waitFinal();
 }
 
-/********* TIME **********************************************************/
+// Read a line of hex digits straight from the port into replybuffer as
+// bytes, so a whole PDU fits where its hex text wouldn't.
+uint16_t SIM90X::readHex(void) {
+  uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS;
+  uint16_t n = 0;
+  uint8_t digits = 0;
 
-boolean SIM90X::enableNetworkTimeSync(boolean onoff) {
-  if (onoff) {
-    if (! sendCheckReply(F("AT+CLTS=1"), F("OK")))
-      return false;
-  } else {
-    if (! sendCheckReply(F("AT+CLTS=0"), F("OK")))
-      return false;
-  }
+  while (timeout) {
+    if (! mySerial->SIM90X_SERIAL(available)()) {
+      timeout -= waitInput(timeout);
+      continue;
+    }
+    char c = mySerial->SIM90X_SERIAL(read)();
+    if (c == '\r' || c == '\n') {
+      if (n || digits) break;
+      continue;
+    }
 
-  flushInput(); // eat any 'Unsolicted Result Code'
+    uint8_t v = (c <= '9') ? c - '0' : (c & ~0x20) - 'A' + 10;
+    if (n < sizeof(replybuffer)) {
+      if (digits & 1)
+        replybuffer[n++] |= v & 0x0F;
+      else
+        replybuffer[n] = v << 4;
+    }
+    digits++;
+  }
 
-  return true;
+  return n;
 }
 
-boolean SIM90X::enableNTPTimeSync(boolean onoff, const __FlashStringHelper *ntpserver) {
-  if (onoff) {
-    if (! sendCheckReply(F("AT+CNTPCID=1"), F("OK")))
-      return false;
+// Read and decode a stored message in PDU mode.
+boolean SIM90X::readSMS(uint8_t i, SIM90X_pdu_t *msg) {
+  boolean ok = false;
 
-    mySerial->print(F("AT+CNTP=\""));
-    if (ntpserver != 0) {
-      mySerial->print(ntpserver);
-    } else {
-      mySerial->print(F("pool.ntp.org"));
-    }
-    mySerial->println(F("\",0"));
-    readline(SIM90X_DEFAULT_TIMEOUT_MS);
-    if (strcmp(replybuffer, "OK") != 0)
-      return false;
+  smstext = false;
+  if (! sendCheckReply(F("AT+CMGF=0"), F("OK"))) return false;
 
-    if (! sendCheckReply(F("AT+CNTP"), F("OK"), 10000))
-      return false;
+  txPrint(F("AT+CMGR="));
+  txPrint(i);
+  txPrintln();
+  readline(timeoutFor(SIM90X_CMD_SMSREAD));
 
-    uint16_t status;
-    readline(10000);
-    if (! parseReply(F("+CNTP:"), &status))
-      return false;
-  } else {
-    if (! sendCheckReply(F("AT+CNTPCID=0"), F("OK")))
-      return false;
+  // "+CMGR: <stat>,[<alpha>],<length>" then the PDU
+  if (strncmp_P(replybuffer, PSTR("+CMGR: "), 7) == 0) {
+    uint16_t n = readHex();
+    ok = SIM90XPDU::deliver((uint8_t *)replybuffer, n, msg);
   }
+  if (! waitFinal()) ok = false;
 
-  return true;
+  smsTextMode();
+  return ok;
 }
 
-boolean SIM90X::getTime(char *buff, uint16_t maxlen) {
-  getReply(F("AT+CCLK?"), (uint16_t) 10000);
-  if (strncmp(replybuffer, "+CCLK: ", 7) != 0)
-    return false;
+/********* SMS DELIVERY *************************************************/
 
-  char *p = replybuffer+7;
-  uint16_t lentocopy = min(maxlen-1, strlen(p));
-  strncpy(buff, p, lentocopy+1);
-  buff[lentocopy] = 0;
+// Copy field <index> of a comma separated header into v. Commas inside
+// quotes (e.g. in the timestamp) don't split fields and quotes are dropped.
+static boolean smsField(const char *p, uint8_t index, char *v, uint8_t maxlen) {
+  boolean quoted = false;
+  uint8_t j = 0;
 
-  readline(); // eat OK
+  for (; *p; p++) {
+    if (*p == '"') {
+      quoted = ! quoted;
+    } else if (*p == ',' && ! quoted) {
+      if (index-- == 0) break;
+    } else if (index == 0 && j < maxlen-1) {
+      v[j++] = *p;
+    }
+  }
+  v[j] = 0;
 
-  return true;
+  return index == 0 || *p;
 }
 
-/********* GPRS **********************************************************/
+// Have incoming messages handed to callback from poll(). Messages are
+// delivered with +CMT (AT+CNMI=2,2) and never stored on the SIM. The ones
+// the modem stores anyway (e.g. class 2) are announced with +CMTI, read
+// back from storage and deleted. A NULL callback goes back to storing
+// every message.
+boolean SIM90X::setSMSCallback(SIM90X_smscallback callback) {
+  smscallback = callback;
+
+  if (! smsTextMode()) return false;
+  if (! sendCheckReply(F("AT+CSDH=1"), F("OK"))) return false;
+
+  if (callback)
+    return sendCheckReply(F("AT+CNMI=2,2,0,0,0"), F("OK"));
+  return sendCheckReply(F("AT+CNMI=2,1,0,0,0"), F("OK"));
+}
+
+// Parse a text mode header with all parameters (AT+CSDH=1), p pointing at
+// the field list and the sender being field <first>. Fills sms when given
+// and returns the number of characters of the text, 0xFFFF if unknown.
+uint16_t SIM90X::smsHeader(const char *p, uint8_t first, SIM90X_sms_t *sms) {
+  char field[8];
+
+  if (sms) {
+    smsField(p, first, sms->sender, sizeof(sms->sender));
+    smsField(p, first+2, sms->timestamp, sizeof(sms->timestamp));
+  }
+
+  if (! smsField(p, first+9, field, sizeof(field)))
+    return 0xFFFF;
+  uint16_t len = atoi(field);
+
+  // 8-bit and UCS2 text is shown as hex, two characters per octet
+  smsField(p, first+6, field, sizeof(field));
+  if (atoi(field) & 0x0C)
+    len *= 2;
+
+  return len;
+}
+
+// Read <len> characters of message text (or up to the end of the line when
+// the length is unknown) straight from the port into sms, or drop them.
+void SIM90X::readSMSText(uint16_t len, SIM90X_sms_t *sms) {
+  uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS;
+  uint16_t got = 0;
+
+  while (len && timeout) {
+    if (! mySerial->SIM90X_SERIAL(available)()) {
+      timeout -= waitInput(timeout);
+      continue;
+    }
+    char c = mySerial->SIM90X_SERIAL(read)();
+    if (len == 0xFFFF) {
+      if (c == '\r') continue;
+      if (c == '\n') {
+        if (got) break;
+        continue;
+      }
+    } else {
+      len--;
+    }
+
+    if (sms && got < sizeof(sms->text)-1)
+      sms->text[got] = c;
+    got++;
+  }
+
+  if (sms) {
+    sms->len = min(got, (uint16_t)(sizeof(sms->text)-1));
+    sms->text[sms->len] = 0;
+  }
+}
+
+// Handle +CMT and +CMTI in replybuffer. True if the line was one of them.
+boolean SIM90X::smsURC(void) {
+  if (! smscallback) return false;
+
+  if (strncmp_P(replybuffer, PSTR("+CMT: "), 6) == 0) {
+    // the header is followed by a CRLF and the text. With AT+CNMI=2,2
+    // nothing is stored, a message that finds the queue full is lost.
+    SIM90X_sms_t *sms = 0;
+    if (smscount < SIM90X_SMS_QUEUE)
+      sms = &smsin[(smshead + smscount) % SIM90X_SMS_QUEUE];
+    readSMSText(smsHeader(replybuffer+6, 0, sms), sms);
+    if (sms)
+      smscount++;
+    else
+      smsdropped++;
+    return true;
+  }
+
+  if (strncmp_P(replybuffer, PSTR("+CMTI: "), 7) == 0) {
+    char *p = strchr(replybuffer, ',');
+    if (p && smsstoredcount < SIM90X_SMS_STORED_MAX)
+      smsstored[smsstoredcount++] = atoi(p+1);
+    return true;
+  }
+
+  return false;
+}
+
+// Read a stored message into smsread with a single AT+CMGR, so a +CMT
+// arriving meanwhile is queued apart.
+boolean SIM90X::readStoredSMS(uint8_t i) {
+  txPrint(F("AT+CMGR="));
+  txPrint(i);
+  txPrintln();
+  readline(timeoutFor(SIM90X_CMD_SMSREAD));
+
+  if (strncmp_P(replybuffer, PSTR("+CMGR: "), 7) != 0) {
+    waitFinal();
+    return false;
+  }
+  readSMSText(smsHeader(replybuffer+7, 1, &smsread), &smsread);
+
+  return waitFinal();
+}
+
+// Hand the messages received so far to the callback.
+void SIM90X::smsDeliver(void) {
+  // not again from a poll() in the callback
+  if (! smscallback || smsdelivering) return;
+  smsdelivering = true;
+
+  // the slot is freed after the callback, a +CMT read meanwhile can't
+  // overwrite it
+  while (smscount) {
+    smscallback(&smsin[smshead]);
+    smshead = (smshead + 1) % SIM90X_SMS_QUEUE;
+    smscount--;
+  }
+
+  while (smsstoredcount) {
+    uint8_t i = smsstored[0];
+    smsstoredcount--;
+    memmove(smsstored, smsstored+1, smsstoredcount);
+
+    if (readStoredSMS(i)) {
+      deleteSMS(i);
+      smscallback(&smsread);
+    }
+  }
+
+  smsdelivering = false;
+}
+
+// +CMT messages lost because SIM90X_SMS_QUEUE were waiting for poll()
+uint16_t SIM90X::droppedSMS(void) {
+  return smsdropped;
+}
+
+#endif
+
+#if SIM90X_ENABLE_PHONEBOOK
+
+/********* PHONEBOOK ****************************************************/
+
+boolean SIM90X::getPhonebook(uint8_t addr, char *number, int number_length, char *name, int name_length) {
+  boolean status;
+  // Send command to retrieve PHONEBOOK item and parse a line of response.
+  txPrint(F("AT+CPBR="));
+  txPrint(addr);
+  txPrintln();
+  readline();
+  // Parse the second field in the response.
+  if((status = parseReplyQuoted(F("+CPBR:"), number, number_length, ',', 1))){
+    parseReplyQuoted(F("+CPBR:"), name, name_length, ',', 3);
+  }
+
+  // Drop any remaining data from the response.
+  waitFinal();
+  return status;
+}
+
+boolean SIM90X::getPhonebookNumber(uint8_t i, char *number, int length) {
+  // Send command to retrieve PHONEBOOK item and parse a line of response.
+  txPrint(F("AT+CPBR="));
+  txPrint(i);
+  txPrintln();
+  readline(1000);
+  // Parse the second field in the response.
+  boolean result = parseReplyQuoted(F("+CPBR:"), number, length, ',', 1);
+  // Drop any remaining data from the response.
+  waitFinal();
+  return result;
+}
+
+boolean SIM90X::getPhonebookName(uint8_t i, char *name, int length) {
+  // Send command to retrieve PHONEBOOK item and parse a line of response.
+  txPrint(F("AT+CPBR="));
+  txPrint(i);
+  txPrintln();
+  readline(1000);
+  // Parse the second field in the response.
+  boolean result = parseReplyQuoted(F("+CPBR:"), name, length, ',', 3);
+  // Drop any remaining data from the response.
+  waitFinal();
+  return result;
+}
+
+uint8_t SIM90X::hasPhonebookNumber(char *number) {
+  uint8_t addr = 0;
+  for(uint8_t i = 0; i < 20; i++){
+    char buffer[24];
+
+    txPrint(F("AT+CPBR="));
+    txPrint(i + 1);
+    txPrintln();
+    readline(1000);
+    if(parseReplyQuoted(F("+CPBR:"), buffer, 24, ',', 1)){
+      if(strcmp(number, buffer) == 0) return (i + 1);
+    }
+    waitFinal();
+  }
+  
+  return addr;
+}
+
+#endif
+
+#if SIM90X_ENABLE_TIME
+
+/********* TIME **********************************************************/
+
+boolean SIM90X::enableNetworkTimeSync(boolean onoff) {
+  timeset = false;
+
+  if (onoff) {
+    if (! sendCheckReply(F("AT+CLTS=1"), F("OK")))
+      return false;
+  } else {
+    if (! sendCheckReply(F("AT+CLTS=0"), F("OK")))
+      return false;
+  }
+
+  flushInput(); // eat any 'Unsolicted Result Code'
+
+  return true;
+}
+
+boolean SIM90X::enableNTPTimeSync(boolean onoff, const __FlashStringHelper *ntpserver) {
+  timeset = false;
+
+  if (onoff) {
+    if (! sendCheckReply(F("AT+CNTPCID=1"), F("OK")))
+      return false;
+
+    txPrint(F("AT+CNTP=\""));
+    if (ntpserver != 0) {
+      txPrint(ntpserver);
+    } else {
+      txPrint(F("pool.ntp.org"));
+    }
+    txPrint(F("\",0"));
+    txPrintln();
+    readline(SIM90X_DEFAULT_TIMEOUT_MS);
+    if (strcmp(replybuffer, "OK") != 0)
+      return false;
+
+    if (! sendCheckReply(F("AT+CNTP"), F("OK"), 10000))
+      return false;
+
+    uint16_t status;
+    readline(timeoutFor(SIM90X_CMD_NTP));
+    if (! parseReply(F("+CNTP:"), &status))
+      return false;
+  } else {
+    if (! sendCheckReply(F("AT+CNTPCID=0"), F("OK")))
+      return false;
+  }
+
+  return true;
+}
+
+// Two decimal digits
+static char *put2(char *p, uint8_t v) {
+  *p++ = '0' + (v / 10) % 10;
+  *p++ = '0' + v % 10;
+  return p;
+}
+
+// Current local time as "yy/MM/dd,hh:mm:ss+zz" (quoted, like +CCLK),
+// served from the local clock.
+boolean SIM90X::getTime(char *buff, uint16_t maxlen) {
+  SIM90X_time_t t;
+  char s[23];
+  char *p = s;
+
+  if (! getTime(&t))
+    return false;
+
+  *p++ = '"';
+  p = put2(p, t.year);   *p++ = '/';
+  p = put2(p, t.month);  *p++ = '/';
+  p = put2(p, t.day);    *p++ = ',';
+  p = put2(p, t.hour);   *p++ = ':';
+  p = put2(p, t.minute); *p++ = ':';
+  p = put2(p, t.second);
+  *p++ = t.tz < 0 ? '-' : '+';
+  p = put2(p, abs(t.tz));
+  *p++ = '"';
+  *p = 0;
+
+  uint16_t lentocopy = min(maxlen-1, strlen(s));
+  memcpy(buff, s, lentocopy);
+  buff[lentocopy] = 0;
+
+  return true;
+}
+
+/********* LOCAL CLOCK **************************************************/
+
+// Seconds since 2000-01-01 00:00:00 and back, for years 2000-2099.
+static uint32_t toSeconds(const SIM90X_time_t *t) {
+  static const uint16_t before[] PROGMEM = {0,31,59,90,120,151,181,212,243,273,304,334};
+  uint32_t d = t->year * 365UL + (t->year + 3) / 4 +
+    pgm_read_word(&before[(t->month - 1) % 12]) + t->day - 1;
+
+  if (t->month > 2 && (t->year % 4) == 0) d++;
+  return ((d * 24 + t->hour) * 60 + t->minute) * 60 + t->second;
+}
+
+static void fromSeconds(uint32_t s, SIM90X_time_t *t) {
+  static const uint8_t mdays[] PROGMEM = {31,28,31,30,31,30,31,31,30,31,30,31};
+  uint16_t d;
+
+  t->second = s % 60; s /= 60;
+  t->minute = s % 60; s /= 60;
+  t->hour = s % 24;
+  d = s / 24;
+
+  for (t->year=0; d >= ((t->year % 4) ? 365 : 366); t->year++)
+    d -= (t->year % 4) ? 365 : 366;
+  for (t->month=1; ; t->month++) {
+    uint8_t n = pgm_read_byte(&mdays[t->month - 1]);
+    if (t->month == 2 && (t->year % 4) == 0) n++;
+    if (d < n) break;
+    d -= n;
+  }
+  t->day = d + 1;
+}
+
+// Parse "yy/MM/dd,hh:mm:ss+zz" (+CCLK) or "yyyy,M,d,h,m,s,"+zz"" (*PSUTTZ).
+// Numbers may be separated by anything, the last one is the signed zone.
+static boolean parseTime(const char *p, SIM90X_time_t *t) {
+  int16_t v[7];
+  uint8_t n = 0;
+
+  while (*p && n < 7) {
+    if (! isdigit(*p)) {
+      p++;
+      continue;
+    }
+    boolean negative = (n == 6 && p[-1] == '-');
+    v[n] = atoi(p);
+    if (negative) v[n] = -v[n];
+    n++;
+    while (isdigit(*p)) p++;
+  }
+  if (n < 7) return false;
+
+  t->year = v[0] % 100;
+  t->month = v[1];
+  t->day = v[2];
+  t->hour = v[3];
+  t->minute = v[4];
+  t->second = v[5];
+  t->tz = v[6];
+
+  return t->month >= 1 && t->month <= 12 && t->day >= 1 && t->day <= 31;
+}
+
+// Anchor the local clock to UTC time utc (seconds since 2000). A clock
+// that is more than SIM90X_TIME_STEP_S off was set, not drifting: it is
+// re-anchored and the drift measurement starts over. Otherwise, once
+// SIM90X_TIME_DRIFT_MIN_S have passed since the drift anchor, how far
+// millis() fell behind gives its drift.
+void SIM90X::setClock(uint32_t utc) {
+  uint32_t now = millis();
+  int32_t step = timeset ? (int32_t)(utc - clockNow()) : 0;
+
+  if (! timeset || step > SIM90X_TIME_STEP_S || step < -SIM90X_TIME_STEP_S) {
+    timedriftutc = utc;
+    timedriftms = now;
+  } else {
+    uint32_t elapsed = (now - timedriftms) / 1000;
+    if (elapsed >= SIM90X_TIME_DRIFT_MIN_S) {
+      // ms gained by the reference over millis(), in ppm
+      int64_t off = (int64_t)(utc - timedriftutc) * 1000 - (now - timedriftms);
+      int64_t ppm = off * 1000 / elapsed;
+      if (ppm > SIM90X_TIME_DRIFT_MAX_PPM) ppm = SIM90X_TIME_DRIFT_MAX_PPM;
+      if (ppm < -SIM90X_TIME_DRIFT_MAX_PPM) ppm = -SIM90X_TIME_DRIFT_MAX_PPM;
+      timedrift += (ppm - timedrift) / 4;
+      timedriftutc = utc;
+      timedriftms = now;
+    }
+  }
+
+  timeutc = utc;
+  timems = now;
+  timeset = true;
+  timefailed = false;
+}
+
+// Read the modem clock (AT+CCLK?) and anchor the local clock to it.
+boolean SIM90X::syncTime(void) {
+  SIM90X_time_t t;
+
+  getReply(F("AT+CCLK?"), timeoutFor(SIM90X_CMD_CLOCK));
+  if (strncmp_P(replybuffer, PSTR("+CCLK: "), 7) != 0 ||
+      ! parseTime(replybuffer+7, &t)) {
+    waitFinal();
+    return false;
+  }
+
+  timetz = t.tz;
+  setClock(toSeconds(&t) - t.tz * 900L);
+  waitFinal(); // eat OK
+
+  return true;
+}
+
+// Resync with the modem every ms milliseconds, 0 never once set.
+void SIM90X::setTimeResync(uint32_t ms) {
+  timeresync = ms;
+}
+
+// UTC seconds since 2000 now, by the local clock
+uint32_t SIM90X::clockNow(void) {
+  uint32_t ms = millis() - timems;
+  // 64 bits, without resyncs ms runs up to 49 days
+  int64_t fix = (int64_t)(ms / 1000) * timedrift / 1000;
+
+  return timeutc + (uint32_t)((ms + fix) / 1000);
+}
+
+// Local time from the clock anchored to the last sync, with the drift of
+// millis() corrected. Only talks to the modem when the clock was never
+// set or the resync interval has passed.
+boolean SIM90X::getTime(SIM90X_time_t *t) {
+  uint32_t now = millis();
+  boolean due = ! timeset || (timeresync && now - timems >= timeresync);
+
+  // after a failed resync keep to the local clock for a while
+  if (due && timeset && timefailed && now - timetried < SIM90X_TIME_RETRY_MS)
+    due = false;
+
+  if (due && ! syncTime()) {
+    timefailed = true;
+    timetried = now;
+    if (! timeset)
+      return false;
+  }
+
+  fromSeconds(clockNow() + timetz * 900L, t);
+  t->tz = timetz;
+  return true;
+}
+
+// Seconds since 1970-01-01 UTC, 0 when the time is unknown
+uint32_t SIM90X::getUnixTime(void) {
+  SIM90X_time_t t;
+
+  if (! getTime(&t))
+    return 0;
+  return clockNow() + 946684800UL;
+}
+
+// Network time zone updates: *PSUTTZ (full UTC time and zone) and
+// +CTZV (zone only), sent after AT+CLTS=1.
+boolean SIM90X::timeURC(void) {
+  SIM90X_time_t t;
+
+  if (strncmp_P(replybuffer, PSTR("*PSUTTZ: "), 9) == 0) {
+    if (parseTime(replybuffer+9, &t)) {
+      timetz = t.tz;
+      setClock(toSeconds(&t));
+    }
+    return true;
+  }
+
+  if (strncmp_P(replybuffer, PSTR("+CTZV: "), 7) == 0) {
+    timetz = atoi(replybuffer+7);
+    return true;
+  }
+
+  return false;
+}
+
+#endif
+
+/********* GPRS **********************************************************/
 
 
 boolean SIM90X::enableGPRS(boolean onoff) {
 
   if (onoff) {
     // disconnect all sockets
-    sendCheckReply(F("AT+CIPSHUT"), F("SHUT OK"), 5000);
+    sendCheckReply(F("AT+CIPSHUT"), F("SHUT OK"), timeoutFor(SIM90X_CMD_TCPSHUT));
 
-    if (! sendCheckReply(F("AT+CGATT=1"), F("OK"), 10000))
+    if (! sendCheckReply(F("AT+CGATT=1"), F("OK"), timeoutFor(SIM90X_CMD_ATTACH)))
       return false;
 
     // set bearer profile! connection type GPRS
@@ -693,18 +1694,18 @@ boolean SIM90X::enableGPRS(boolean onoff) {
     }
 
     // open GPRS context
-    if (! sendCheckReply(F("AT+SAPBR=1,1"), F("OK"), 10000))
+    if (! sendCheckReply(F("AT+SAPBR=1,1"), F("OK"), timeoutFor(SIM90X_CMD_BEARER)))
       return false;
   } else {
     // disconnect all sockets
-    if (! sendCheckReply(F("AT+CIPSHUT"), F("SHUT OK"), 5000))
+    if (! sendCheckReply(F("AT+CIPSHUT"), F("SHUT OK"), timeoutFor(SIM90X_CMD_TCPSHUT)))
       return false;
 
     // close GPRS context
-    if (! sendCheckReply(F("AT+SAPBR=0,1"), F("OK"), 10000))
+    if (! sendCheckReply(F("AT+SAPBR=0,1"), F("OK"), timeoutFor(SIM90X_CMD_BEARER)))
       return false;
 
-    if (! sendCheckReply(F("AT+CGATT=0"), F("OK"), 10000))
+    if (! sendCheckReply(F("AT+CGATT=0"), F("OK"), timeoutFor(SIM90X_CMD_ATTACH)))
       return false;
 
   }
@@ -735,7 +1736,7 @@ void SIM90X::setGPRSNetworkSettings(char *apn, char *username, char *password) {
 
 boolean SIM90X::getGSMLoc(uint16_t *errorcode, char *buff, uint16_t maxlen) {
 
-  getReply(F("AT+CIPGSMLOC=1,1"), (uint16_t)10000);
+  getReply(F("AT+CIPGSMLOC=1,1"), timeoutFor(SIM90X_CMD_GSMLOC));
 
   if (! parseReply(F("+CIPGSMLOC: "), errorcode))
     return false;
@@ -744,25 +1745,40 @@ boolean SIM90X::getGSMLoc(uint16_t *errorcode, char *buff, uint16_t maxlen) {
   uint16_t lentocopy = min(maxlen-1, strlen(p));
   strncpy(buff, p, lentocopy+1);
 
-  readline(); // eat OK
+  waitFinal(); // eat OK
 
   return true;
 }
 
+#if SIM90X_ENABLE_TCP
+
 /********* TCP FUNCTIONS  ************************************/
 
 
-boolean SIM90X::TCPconnect(char *server, uint16_t port) {
+boolean SIM90X::TCPconnect(char *server, uint16_t port, uint8_t rxmode) {
   flushInput();
 
   // close all old connections
-  if (! sendCheckReply(F("AT+CIPSHUT"), F("SHUT OK"), 5000) ) return false;
+  if (! sendCheckReply(F("AT+CIPSHUT"), F("SHUT OK"), timeoutFor(SIM90X_CMD_TCPSHUT)) ) return false;
 
   // single connection at a time
   if (! sendCheckReply(F("AT+CIPMUX=0"), F("OK")) ) return false;
 
-  // manually read data
-  if (! sendCheckReply(F("AT+CIPRXGET=1"), F("OK")) ) return false;
+  // normal mode, TCPtransparent() may have left it in transparent mode
+  if (! sendCheckReply(F("AT+CIPMODE=0"), F("OK")) ) return false;
+
+  tcprxmode = rxmode;
+  tcprxhead = tcprxtail = 0;
+  tcprxdropped = 0;
+
+  if (rxmode == SIM90X_TCP_PUSH) {
+    // let the modem push data as "+IPD,<len>:<data>"
+    if (! sendCheckReply(F("AT+CIPRXGET=0"), F("OK")) ) return false;
+    if (! sendCheckReply(F("AT+CIPHEAD=1"), F("OK")) ) return false;
+  } else {
+    // manually read data
+    if (! sendCheckReply(F("AT+CIPRXGET=1"), F("OK")) ) return false;
+  }
 
 #ifdef SIM90X_DEBUG
   Serial.print(F("AT+CIPSTART=\"TCP\",\""));
@@ -772,14 +1788,17 @@ boolean SIM90X::TCPconnect(char *server, uint16_t port) {
   Serial.println(F("\""));
 #endif
 
-  mySerial->print(F("AT+CIPSTART=\"TCP\",\""));
-  mySerial->print(server);
-  mySerial->print(F("\",\""));
-  mySerial->print(port);
-  mySerial->println(F("\""));
+  txPrint(F("AT+CIPSTART=\"TCP\",\""));
+  txPrint(server);
+  txPrint(F("\",\""));
+  txPrint(port);
+  txPrint(F("\""));
+  txPrintln();
 
   if (! expectReply(F("OK"))) return false;
   if (! expectReply(F("CONNECT OK"))) return false;
+
+  return true;
 }
 
 boolean SIM90X::TCPclose(void) {
@@ -795,7 +1814,7 @@ boolean SIM90X::TCPconnected(void) {
   return (strcmp(replybuffer, "STATE: CONNECT OK") == 0);
 }
 
-boolean SIM90X::TCPsend(char *packet, uint8_t len) {
+boolean SIM90X::TCPsend(char *packet, uint16_t len) {
 
 #ifdef SIM90X_DEBUG
   Serial.print(F("AT+CIPSEND="));
@@ -809,16 +1828,14 @@ boolean SIM90X::TCPsend(char *packet, uint8_t len) {
 #endif
 
 
-  mySerial->print(F("AT+CIPSEND="));
-  mySerial->println(len);
-  readline();
-#ifdef SIM90X_DEBUG
-  Serial.print (F("\t<--- ")); Serial.println(replybuffer);
-#endif
-  if (replybuffer[0] != '>') return false;
+  txPrint(F("AT+CIPSEND="));
+  txPrint(len);
+  txPrintln();
+  // "> " has no line end, don't wait for one
+  if (! waitPrompt()) return false;
 
-  mySerial->write(packet, len);
-  readline(3000); // wait up to 3 seconds to send the data
+  txWrite((uint8_t *)packet, len);
+  readline(timeoutFor(SIM90X_CMD_TCPSEND)); // wait for the data to be sent
 #ifdef SIM90X_DEBUG
   Serial.print (F("\t<--- ")); Serial.println(replybuffer);
 #endif
@@ -829,6 +1846,12 @@ boolean SIM90X::TCPsend(char *packet, uint8_t len) {
 uint16_t SIM90X::TCPavailable(void) {
   uint16_t avail;
 
+  if (tcprxmode == SIM90X_TCP_PUSH) {
+    // pushed data is already (or about to be) in the local buffer
+    poll();
+    return (tcprxhead + SIM90X_TCP_RXBUFFER_SIZE - tcprxtail) % SIM90X_TCP_RXBUFFER_SIZE;
+  }
+
   if (! sendParseReply(F("AT+CIPRXGET=4"), F("+CIPRXGET: 4,"), &avail, ',', 0) ) return false;
 
 #ifdef SIM90X_DEBUG
@@ -839,30 +1862,154 @@ uint16_t SIM90X::TCPavailable(void) {
 }
 
 
-uint16_t SIM90X::TCPread(uint8_t *buff, uint8_t len) {
+uint32_t SIM90X::TCPoverflow(void) {
+  return tcprxdropped;
+}
+
+uint16_t SIM90X::TCPread(uint8_t *buff, uint16_t len) {
   uint16_t avail;
 
-  mySerial->print(F("AT+CIPRXGET=2,"));
-  mySerial->println(len);
+  if (tcprxmode == SIM90X_TCP_PUSH) {
+    poll();
+    avail = 0;
+    while (avail < len && tcprxtail != tcprxhead) {
+      buff[avail++] = tcprxbuff[tcprxtail];
+      tcprxtail = (tcprxtail + 1) % SIM90X_TCP_RXBUFFER_SIZE;
+    }
+    return avail;
+  }
+
+  // never ask for more than replybuffer can hold
+  len = min(len, (uint16_t)(sizeof(replybuffer)-1));
+
+  txPrint(F("AT+CIPRXGET=2,"));
+  txPrint(len);
+  txPrintln();
   readline();
   if (! parseReply(F("+CIPRXGET: 2,"), &avail, ',', 0)) return false;
 
   readRaw(avail);
 
-#ifdef SIM90X_DEBUG
-  Serial.print (avail); Serial.println(F(" bytes read"));
-  for (uint8_t i=0;i<avail;i++) {
-    Serial.print(" 0x"); Serial.print(replybuffer[i], HEX);
-  }
-  Serial.println(); 
-#endif
+#ifdef SIM90X_DEBUG
+  Serial.print (avail); Serial.println(F(" bytes read"));
+  for (uint16_t i=0;i<avail;i++) {
+    Serial.print(" 0x"); Serial.print(replybuffer[i], HEX);
+  }
+  Serial.println(); 
+#endif
+
+  memcpy(buff, replybuffer, avail);
+    
+  return avail;
+}
+
+/********* TCP TRANSPARENT MODE  ****************************/
+
+// Open a TCP connection in transparent mode (AT+CIPMODE=1). On success
+// the modem is in data mode and every byte written to / read from this
+// Stream goes straight to the socket, without any AT+CIPSEND framing.
+boolean SIM90X::TCPtransparent(char *server, uint16_t port) {
+  flushInput();
+
+  // close all old connections
+  if (! sendCheckReply(F("AT+CIPSHUT"), F("SHUT OK"), timeoutFor(SIM90X_CMD_TCPSHUT)) ) return false;
+
+  // single connection at a time
+  if (! sendCheckReply(F("AT+CIPMUX=0"), F("OK")) ) return false;
+
+  // data is pushed to the serial port, CIPRXGET is not allowed here
+  if (! sendCheckReply(F("AT+CIPRXGET=0"), F("OK")) ) return false;
+
+  // raw data isn't framed: don't look for "+IPD," in it
+  tcprxmode = SIM90X_TCP_RXGET;
+  tcprxhead = tcprxtail = 0;
+
+  if (! sendCheckReply(F("AT+CIPMODE=1"), F("OK")) ) return false;
+
+#ifdef SIM90X_DEBUG
+  Serial.print(F("AT+CIPSTART=\"TCP\",\""));
+  Serial.print(server);
+  Serial.print(F("\",\""));
+  Serial.print(port);
+  Serial.println(F("\""));
+#endif
+
+  txPrint(F("AT+CIPSTART=\"TCP\",\""));
+  txPrint(server);
+  txPrint(F("\",\""));
+  txPrint(port);
+  txPrint(F("\""));
+  txPrintln();
+
+  // in transparent mode the modem answers CONNECT instead of CONNECT OK
+  if (! expectReply(F("OK")) || ! expectReply(F("CONNECT"))) {
+    // don't leave the next TCPconnect() in transparent mode
+    sendCheckReply(F("AT+CIPMODE=0"), F("OK"));
+    return false;
+  }
+
+  transparent = true;
+  closedidx = 0;
+  lasttx = millis();
+  return true;
+}
+
+// Leave data mode with the "+++" escape sequence. The connection stays
+// open and can be resumed later with TCPresume().
+boolean SIM90X::TCPescape(void) {
+  if (! transparent) return false;
+
+  // no data may be sent for the guard time before "+++"...
+  uint32_t idle = millis() - lasttx;
+  if (idle < SIM90X_ESCAPE_GUARD_BEFORE_MS)
+    delay(SIM90X_ESCAPE_GUARD_BEFORE_MS - idle);
+
+  txWrite((const uint8_t *)"+++", 3);
+
+  // ...and after it
+  delay(SIM90X_ESCAPE_GUARD_AFTER_MS);
+
+  // drop any socket data received before the modem switched to command mode
+  transparent = false;
+  uint32_t start = millis();
+  while (millis() - start < SIM90X_DEFAULT_TIMEOUT_MS) {
+    readline();
+    if (strcmp_P(replybuffer, PSTR("OK")) == 0)
+      return true;
+  }
+
+  transparent = true;
+  return false;
+}
+
+// Go back to data mode after a TCPescape().
+boolean SIM90X::TCPresume(void) {
+  if (transparent) return true;
+
+  if (! sendCheckReply(F("ATO"), F("CONNECT"), 1000)) return false;
+
+  transparent = true;
+  closedidx = 0;
+  lasttx = millis();
+  return true;
+}
+
+// Close the transparent connection and restore normal (CIPMODE=0) mode.
+boolean SIM90X::TCPtransparentClose(void) {
+  if (transparent && ! TCPescape()) return false;
+
+  sendCheckReply(F("AT+CIPCLOSE"), F("CLOSE OK"), 1000);
+
+  return sendCheckReply(F("AT+CIPMODE=0"), F("OK"));
+}
 
-  memcpy(buff, replybuffer, avail);
-    
-  return avail;
+boolean SIM90X::isTransparent(void) {
+  return transparent;
 }
 
+#endif
 
+#if SIM90X_ENABLE_HTTP
 
 /********* HTTP LOW LEVEL FUNCTIONS  ************************************/
 
@@ -874,8 +2021,16 @@ boolean SIM90X::HTTP_term() {
   return sendCheckReply(F("AT+HTTPTERM"), F("OK"));
 }
 
+// Start an AT+HTTPPARA command whose value is written by the caller,
+// then finished with HTTP_para_end().
 void SIM90X::HTTP_para_start(const __FlashStringHelper *parameter,
                                     boolean quoted) {
+  HTTP_para_begin(parameter, quoted);
+  txFlush();
+}
+
+void SIM90X::HTTP_para_begin(const __FlashStringHelper *parameter,
+                                    boolean quoted) {
   flushInput();
 
 #ifdef SIM90X_DEBUG
@@ -885,41 +2040,40 @@ void SIM90X::HTTP_para_start(const __FlashStringHelper *parameter,
   Serial.println('"');
 #endif
 
-  mySerial->print(F("AT+HTTPPARA=\""));
-  mySerial->print(parameter);
+  txPrint(F("AT+HTTPPARA=\""));
+  txPrint(parameter);
   if (quoted)
-    mySerial->print(F("\",\""));
+    txPrint(F("\",\""));
   else
-    mySerial->print(F("\","));
+    txPrint(F("\","));
 }
 
 boolean SIM90X::HTTP_para_end(boolean quoted) {
   if (quoted)
-    mySerial->println('"');
-  else
-    mySerial->println();
+    txPrint(F("\""));
+  txPrintln();
 
   return expectReply(F("OK"));
 }
 
 boolean SIM90X::HTTP_para(const __FlashStringHelper *parameter, 
                                  const char *value) {
-  HTTP_para_start(parameter, true);
-  mySerial->print(value);
+  HTTP_para_begin(parameter, true);
+  txPrint(value);
   return HTTP_para_end(true);
 }
 
 boolean SIM90X::HTTP_para(const __FlashStringHelper *parameter, 
                                  const __FlashStringHelper *value) {
-  HTTP_para_start(parameter, true);
-  mySerial->print(value);
+  HTTP_para_begin(parameter, true);
+  txPrint(value);
   return HTTP_para_end(true);
 }
 
 boolean SIM90X::HTTP_para(const __FlashStringHelper *parameter, 
                                  int32_t value) {
-  HTTP_para_start(parameter, false);
-  mySerial->print(value);
+  HTTP_para_begin(parameter, false);
+  txPrint(value);
   return HTTP_para_end(false);
 }
 
@@ -934,26 +2088,46 @@ boolean SIM90X::HTTP_data(uint32_t size, uint32_t maxTime) {
   Serial.println(maxTime);
 #endif
 
-  mySerial->print(F("AT+HTTPDATA="));
-  mySerial->print(size);
-  mySerial->print(",");
-  mySerial->println(maxTime);
+  txPrint(F("AT+HTTPDATA="));
+  txPrint(size);
+  txPrint(F(","));
+  txPrint(maxTime);
+  txPrintln();
 
   return expectReply(F("DOWNLOAD"));
 }
 
-boolean SIM90X::HTTP_action(uint8_t method, uint16_t *status, 
+// Fails when the body is over 65535 bytes, see the uint32_t version.
+boolean SIM90X::HTTP_action(uint8_t method, uint16_t *status,
                                    uint16_t *datalen, int32_t timeout) {
+  uint32_t len;
+
+  if (! HTTP_action(method, status, &len, timeout))
+    return false;
+  if (len > 0xFFFF)
+    return false;
+
+  *datalen = len;
+  return true;
+}
+
+boolean SIM90X::HTTP_action(uint8_t method, uint16_t *status,
+                                   uint32_t *datalen, int32_t timeout) {
   // Send request.
   if (! sendCheckReply(F("AT+HTTPACTION="), method, F("OK")))
     return false;
 
   // Parse response status and size.
-  readline(timeout);
+  readline(timeout ? timeout : timeoutFor(SIM90X_CMD_HTTP));
   if (! parseReply(F("+HTTPACTION:"), status, ',', 1))
     return false;
-  if (! parseReply(F("+HTTPACTION:"), datalen, ',', 2))
+
+  // +HTTPACTION: <method>,<status>,<datalen>
+  char *p = strchr(replybuffer, ',');
+  if (p) p = strchr(p+1, ',');
+  if (p == 0)
     return false;
+  *datalen = strtoul(p+1, 0, 10);
 
   return true;
 }
@@ -970,6 +2144,34 @@ boolean SIM90X::HTTP_ssl(boolean onoff) {
   return sendCheckReply(F("AT+HTTPSSL="), onoff ? 1 : 0, F("OK"));
 }
 
+// Copy the value of response header <name> of the last HTTPACTION into
+// value. Header names are matched case-insensitively.
+boolean SIM90X::HTTP_header(const __FlashStringHelper *name, char *value, uint16_t maxlen) {
+  uint8_t namelen = strlen_P((prog_char*)name);
+  boolean found = false;
+
+  getReply(F("AT+HTTPHEAD"));
+  if (strncmp_P(replybuffer, PSTR("+HTTPHEAD: "), 11) != 0)
+    return false;
+
+  // one header per line up to the final OK
+  while (readline()) {
+    if (finalResult())
+      break;
+    if (found || strncasecmp_P(replybuffer, (prog_char*)name, namelen) != 0 ||
+        replybuffer[namelen] != ':')
+      continue;
+
+    char *p = replybuffer + namelen + 1;
+    while (*p == ' ') p++;
+    strncpy(value, p, maxlen-1);
+    value[maxlen-1] = 0;
+    found = true;
+  }
+
+  return found;
+}
+
 /********* HTTP HIGH LEVEL FUNCTIONS ***************************/
 
 boolean SIM90X::HTTP_GET_start(char *url,
@@ -1011,7 +2213,7 @@ boolean SIM90X::HTTP_POST_start(char *url,
   // HTTP POST data
   if (! HTTP_data(postdatalen, 10000))
     return false;
-  mySerial->write(postdata, postdatalen);
+  txWrite(postdata, postdatalen);
   if (! expectReply(F("OK")))
     return false;
 
@@ -1035,6 +2237,54 @@ void SIM90X::HTTP_POST_end(void) {
   HTTP_term();
 }
 
+void SIM90X::setHTTPCache(SIM90X_httpvalidator_t *cache, uint8_t entries) {
+  httpcache = cache;
+  httpcachesize = entries;
+  httpcachenext = 0;
+}
+
+// Like HTTP_GET_start(), but sends the ETag (or Last-Modified date) seen
+// the last time this URL was fetched. When the server answers 304 Not
+// Modified the body is not read at all and *datalen is 0.
+boolean SIM90X::HTTP_GET_cached(char *url, uint16_t *status, uint16_t *datalen) {
+  uint32_t key = ~crc32_update(0xFFFFFFFFUL, (uint8_t *)url, strlen(url));
+  if (key == 0) key = 1;
+
+  if (! HTTP_setup(url))
+    return false;
+
+  SIM90X_httpvalidator_t *validator = HTTP_cacheEntry(key, false);
+  if (validator) {
+    char header[SIM90X_HTTP_VALIDATOR_LEN + 20];
+    if (validator->etag[0])
+      sprintf_P(header, PSTR("If-None-Match: %s"), validator->etag);
+    else
+      sprintf_P(header, PSTR("If-Modified-Since: %s"), validator->lastmodified);
+    if (! HTTP_para(F("USERDATA"), header))
+      return false;
+  }
+
+  if (! HTTP_action(SIM90X_HTTP_GET, status, datalen))
+    return false;
+
+  if (*status == 304) {
+    *datalen = 0;
+    return true;
+  }
+
+  // remember the new validators for next time
+  if (*status == 200 && httpcache) {
+    SIM90X_httpvalidator_t fresh;
+    if (HTTP_validators(&fresh)) {
+      validator = HTTP_cacheEntry(key, true);
+      *validator = fresh;
+      validator->key = key;
+    }
+  }
+
+  return HTTP_readall(datalen);
+}
+
 void SIM90X::setUserAgent(const __FlashStringHelper *useragent) {
   this->useragent = useragent;
 }
@@ -1043,8 +2293,232 @@ void SIM90X::setHTTPSRedirect(boolean onoff) {
   httpsredirect = onoff;
 }
 
+#endif
+
+/********* RESUMABLE DOWNLOADS *********************************/
+
+void SIM90X::downloadBegin(SIM90X_download_t *progress) {
+  progress->offset = 0;
+  progress->crc = 0xFFFFFFFFUL;
+}
+
+// CRC-32 of everything delivered so far, comparable with the usual crc32 tools.
+uint32_t SIM90X::downloadCRC(const SIM90X_download_t *progress) {
+  return ~progress->crc;
+}
+
+// Hand the first len bytes of replybuffer to the sink and record progress.
+boolean SIM90X::downloadChunk(SIM90X_download_t *progress, SIM90X_sink sink,
+                              void *ctx, uint16_t len) {
+  if (! sink((uint8_t *)replybuffer, len, ctx)) return false;
+
+  progress->crc = crc32_update(progress->crc, (uint8_t *)replybuffer, len);
+  progress->offset += len;
+  return true;
+}
+
+#if SIM90X_ENABLE_FTP
+
+// Configure the FTP session on bearer profile 1 (see enableGPRS).
+boolean SIM90X::FTP_setup(const char *server, uint16_t port, const char *user, const char *pass) {
+  if (! sendCheckReply(F("AT+FTPCID=1"), F("OK"))) return false;
+  if (! sendCheckReplyQuoted(F("AT+FTPSERV="), server, F("OK"))) return false;
+  if (! sendCheckReply(F("AT+FTPPORT="), port, F("OK"))) return false;
+  if (user && ! sendCheckReplyQuoted(F("AT+FTPUN="), user, F("OK"))) return false;
+  if (pass && ! sendCheckReplyQuoted(F("AT+FTPPW="), pass, F("OK"))) return false;
+  return true;
+}
+
+// Download path/file (path ends with '/') starting at progress->offset.
+// Returns true once the whole file went to the sink. On failure progress
+// tells where to restart from after the bearer is back.
+boolean SIM90X::FTP_download(const char *path, const char *file,
+                             SIM90X_download_t *progress, SIM90X_sink sink, void *ctx) {
+  uint16_t status, len;
+  boolean finished = false;
+
+  if (! sendCheckReplyQuoted(F("AT+FTPGETNAME="), file, F("OK"))) return false;
+  if (! sendCheckReplyQuoted(F("AT+FTPGETPATH="), path, F("OK"))) return false;
+
+  // resume where the last attempt stopped
+  if (! sendCheckReply(F("AT+FTPREST="), progress->offset, F("OK"))) return false;
+
+  // open the session, "+FTPGET: 1,1" means data is ready
+  if (! sendCheckReply(F("AT+FTPGET=1"), F("OK"))) return false;
+  readline(SIM90X_FTP_TIMEOUT_MS);
+  if (! parseReply(F("+FTPGET: 1,"), &status) || status != 1) return false;
+
+  while (true) {
+    txPrint(F("AT+FTPGET=2,"));
+    txPrint(sizeof(replybuffer)-1);
+    txPrintln();
+
+    // "+FTPGET: 1,<status>" session events may come before the reply
+    boolean gotdata = false;
+    while (readline(SIM90X_FTP_TIMEOUT_MS)) {
+      if (parseReply(F("+FTPGET: 2,"), &len)) {
+        gotdata = true;
+        break;
+      }
+      if (parseReply(F("+FTPGET: 1,"), &status)) {
+        if (status == 0) finished = true;
+        else if (status != 1) return false;
+        continue;
+      }
+      if (finalResult()) break;
+    }
+    // the modem refuses reads once the session has ended
+    if (! gotdata) return finished;
+
+    if (len) {
+      uint16_t got = readRaw(len);
+      if (! downloadChunk(progress, sink, ctx, got)) return false;
+      if (got != len) return false;
+      waitFinal(); // eat 'OK'
+      continue;
+    }
+
+    waitFinal(); // eat 'OK'
+    if (finished) return true;
+
+    // nothing buffered yet, wait for the next session event
+    readline(SIM90X_FTP_TIMEOUT_MS);
+    if (! parseReply(F("+FTPGET: 1,"), &status)) return false;
+    if (status == 0) return true;
+    if (status != 1) return false;
+  }
+}
+
+#endif
+
+#if SIM90X_ENABLE_HTTP
+
+// Download url starting at progress->offset using "Range:" requests of
+// SIM90X_HTTP_RANGE_SIZE bytes. Servers that ignore ranges answer 200 with
+// the whole body; the part already delivered is then skipped.
+boolean SIM90X::HTTP_download(char *url, SIM90X_download_t *progress,
+                              SIM90X_sink sink, void *ctx) {
+  char range[40];
+  uint16_t status, got;
+  uint32_t datalen;
+
+  if (! HTTP_setup(url))
+    return false;
+
+  while (true) {
+    sprintf_P(range, PSTR("Range: bytes=%lu-%lu"), (unsigned long)progress->offset,
+              (unsigned long)(progress->offset + SIM90X_HTTP_RANGE_SIZE - 1));
+    if (! HTTP_para(F("USERDATA"), range))
+      return false;
+
+    if (! HTTP_action(SIM90X_HTTP_GET, &status, &datalen))
+      return false;
+
+    // 416: nothing left past the offset
+    if (status == 416)
+      break;
+
+    uint32_t pos = 0;
+    if (status == 200) {
+      pos = progress->offset;
+    } else if (status == 206) {
+      // "bytes <start>-<end>/<total>", the range must start at the offset
+      if (! HTTP_header(F("Content-Range"), range, sizeof(range)) ||
+          strncmp_P(range, PSTR("bytes "), 6) != 0 ||
+          strtoul(range+6, 0, 10) != progress->offset)
+        return false;
+    } else {
+      return false;
+    }
+
+    while (pos < datalen) {
+      if (! HTTP_read(pos, min((uint32_t)(sizeof(replybuffer)-1), datalen - pos), &got))
+        return false;
+      if (! downloadChunk(progress, sink, ctx, got))
+        return false;
+      waitFinal(); // eat 'OK'
+      pos += got;
+    }
+
+    if (status == 200 || datalen < SIM90X_HTTP_RANGE_SIZE)
+      break;
+  }
+
+  HTTP_term();
+  return true;
+}
+
 /********* HTTP HELPERS ****************************************/
 
+// Read ETag and Last-Modified of the last response with one AT+HTTPHEAD.
+boolean SIM90X::HTTP_validators(SIM90X_httpvalidator_t *validator) {
+  validator->etag[0] = 0;
+  validator->lastmodified[0] = 0;
+
+  getReply(F("AT+HTTPHEAD"));
+  if (strncmp_P(replybuffer, PSTR("+HTTPHEAD: "), 11) != 0)
+    return false;
+
+  while (readline()) {
+    char *field;
+    char *p;
+    if (finalResult())
+      break;
+
+    if (strncasecmp_P(replybuffer, PSTR("ETag:"), 5) == 0) {
+      field = validator->etag;
+      p = replybuffer + 5;
+    } else if (strncasecmp_P(replybuffer, PSTR("Last-Modified:"), 14) == 0) {
+      field = validator->lastmodified;
+      p = replybuffer + 14;
+    } else {
+      continue;
+    }
+
+    while (*p == ' ') p++;
+    // a truncated validator would never match, don't keep it
+    if (strlen(p) >= SIM90X_HTTP_VALIDATOR_LEN)
+      continue;
+    strcpy(field, p);
+  }
+
+  return validator->etag[0] || validator->lastmodified[0];
+}
+
+// Find the cache slot for key. With create, reuse an empty slot or evict
+// the oldest one when the key isn't cached yet.
+SIM90X_httpvalidator_t *SIM90X::HTTP_cacheEntry(uint32_t key, boolean create) {
+  for (uint8_t i=0; i<httpcachesize; i++) {
+    if (httpcache[i].key == key) return &httpcache[i];
+  }
+  if (! create || ! httpcachesize) return 0;
+
+  for (uint8_t i=0; i<httpcachesize; i++) {
+    if (httpcache[i].key == 0) return &httpcache[i];
+  }
+  SIM90X_httpvalidator_t *victim = &httpcache[httpcachenext];
+  httpcachenext = (httpcachenext + 1) % httpcachesize;
+  return victim;
+}
+
+// Read len bytes of the response body from start into replybuffer. The
+// trailing 'OK' is left for the caller once it is done with the data.
+boolean SIM90X::HTTP_read(uint32_t start, uint16_t len, uint16_t *readlen) {
+  flushInput();
+
+  txPrint(F("AT+HTTPREAD="));
+  txPrint(start);
+  txPrint(F(","));
+  txPrint(len);
+  txPrintln();
+
+  readline();
+  if (! parseReply(F("+HTTPREAD: "), readlen))
+    return false;
+
+  return (*readlen > 0) && (readRaw(*readlen) == *readlen);
+}
+
 boolean SIM90X::HTTP_setup(char *url) {
   // Handle any pending
   HTTP_term();
@@ -1071,6 +2545,8 @@ boolean SIM90X::HTTP_setup(char *url) {
   return true;
 }
 
+#endif
+
 /********* HELPERS *********************************************/
 
 boolean SIM90X::expectReply(const __FlashStringHelper *reply,
@@ -1079,51 +2555,327 @@ boolean SIM90X::expectReply(const __FlashStringHelper *reply,
 #ifdef SIM90X_DEBUG
   Serial.print(F("\t<--- ")); Serial.println(replybuffer);
 #endif
-  return (strcmp_P(replybuffer, (prog_char*)reply) == 0);
+  return checkReply(reply);
+}
+
+/********* TX ASSEMBLY *****************************************/
+
+// Commands are assembled in txbuffer and handed to the port with a single
+// write, instead of one print() per fragment.
+
+void SIM90X::txPut(char c) {
+  if (txlen == sizeof(txbuffer))
+    txFlush();
+  txbuffer[txlen++] = c;
+}
+
+void SIM90X::txPrint(const char *s) {
+  while (*s) txPut(*s++);
+}
+
+void SIM90X::txPrint(const __FlashStringHelper *s) {
+  prog_char *p = (prog_char*)s;
+  char c;
+  while ((c = pgm_read_byte(p++))) txPut(c);
+}
+
+void SIM90X::txPrint(int32_t v) {
+  char buf[12];
+  uint8_t i = sizeof(buf) - 1;
+  uint32_t u = (v < 0) ? -(uint32_t)v : v;
+
+  buf[i] = 0;
+  do {
+    buf[--i] = '0' + (u % 10);
+    u /= 10;
+  } while (u);
+  if (v < 0) buf[--i] = '-';
+
+  txPrint(buf + i);
+}
+
+// End the command line and send it.
+void SIM90X::txPrintln(void) {
+  if (dataMode()) {
+    txlen = 0;
+    lasterror = SIM90X_ERROR_DATAMODE;
+    return;
+  }
+
+  txPut('\r');
+  txPut('\n');
+  txFlush();
+
+  // a new command, forget the previous result
+  lasterror = SIM90X_ERROR_NONE;
+  lasterrorcode = 0;
+  pending = true;
+}
+
+void SIM90X::txFlush(void) {
+  if (! txlen) return;
+  if (dataMode()) {
+    // a command would go out as socket data
+    txlen = 0;
+    return;
+  }
+
+  mySerial->write((uint8_t *)txbuffer, txlen);
+  txwrites++;
+  txbytes += txlen;
+  txlen = 0;
+}
+
+// Send raw data (anything pending goes out first).
+void SIM90X::txWrite(const uint8_t *buf, uint16_t len) {
+  txFlush();
+  mySerial->write(buf, len);
+  txwrites++;
+  txbytes += len;
+}
+
+void SIM90X::getTXStats(uint32_t *bytes, uint32_t *writes) {
+  *bytes = txbytes;
+  *writes = txwrites;
+}
+
+void SIM90X::resetTXStats(void) {
+  txbytes = 0;
+  txwrites = 0;
+}
+
+/********* ADAPTIVE TIMEOUTS ***********************************/
+
+// Initial, minimum and maximum deadline in ms of each SIM90X_CMD_* class.
+// The initial values are used until the first reply of the class was
+// timed. The floor keeps a few fast replies from starving a slow one of
+// the same class: half the initial value, or all of it for HTTPACTION,
+// whose time depends on the size of a body not known up front.
+static const uint16_t timeoutlimits[SIM90X_CMD_COUNT][3] PROGMEM = {
+  {  1000,   500,  3000 },  // SIM90X_CMD_SMSREAD
+  { 10000,  5000, 30000 },  // SIM90X_CMD_SMSSEND
+  {  3000,  1500, 10000 },  // SIM90X_CMD_TCPSEND
+  {  5000,  2500, 10000 },  // SIM90X_CMD_TCPSHUT
+  { 10000,  5000, 20000 },  // SIM90X_CMD_ATTACH
+  { 10000, 10000, 30000 },  // SIM90X_CMD_HTTP
+  { 10000,  5000, 10000 },  // SIM90X_CMD_CLOCK
+  { 10000,  5000, 30000 },  // SIM90X_CMD_BEARER
+  { 10000,  5000, 20000 },  // SIM90X_CMD_NTP
+  { 10000,  5000, 20000 },  // SIM90X_CMD_GSMLOC
+};
+
+uint16_t SIM90X::getTimeout(uint8_t cmd) {
+  uint16_t initial = pgm_read_word(&timeoutlimits[cmd][0]);
+#if SIM90X_ADAPTIVE_TIMEOUTS
+  uint16_t low = pgm_read_word(&timeoutlimits[cmd][1]);
+  uint16_t cap = pgm_read_word(&timeoutlimits[cmd][2]);
+  uint32_t t;
+
+  if (! latency[cmd].srtt) return initial;
+
+  t = (uint32_t)latency[cmd].srtt + 4 * (uint32_t)latency[cmd].rttvar;
+  if (t < low) t = low;
+  if (t > cap) t = cap;
+  return t;
+#else
+  return initial;
+#endif
+}
+
+// Deadline for the next reply of class cmd. Starts timing that reply, the
+// next readline() records how long it took.
+uint16_t SIM90X::timeoutFor(uint8_t cmd) {
+  timedcmd = cmd;
+  timedstart = millis();
+  return getTimeout(cmd);
+}
+
+// Smoothed latency and mean deviation as for TCP retransmits (RFC 6298).
+// A timeout doubles the deadline so a congested cell can't keep failing.
+void SIM90X::latencySample(uint8_t cmd, uint16_t ms, boolean timedout) {
+  SIM90X_latency_t *l = &latency[cmd];
+
+  if (timedout) {
+    if (! l->srtt) return;
+    uint32_t v = ((uint32_t)getTimeout(cmd) * 2 - l->srtt) / 4;
+    l->rttvar = min(v, (uint32_t)0xFFFF);
+    return;
+  }
+
+  if (! l->srtt) {
+    l->srtt = ms;
+    l->rttvar = ms / 2;
+  } else {
+    int32_t err = (int32_t)ms - l->srtt;
+    l->srtt += err / 8;
+    if (err < 0) err = -err;
+    l->rttvar += (err - (int32_t)l->rttvar) / 4;
+  }
+  if (! l->srtt) l->srtt = 1;  // 0 means nothing learned yet
+}
+
+void SIM90X::getLatencyModel(SIM90X_latency_t *model) {
+  memcpy(model, latency, sizeof(latency));
+}
+
+void SIM90X::setLatencyModel(const SIM90X_latency_t *model) {
+  memcpy(latency, model, sizeof(latency));
 }
 
 /********* LOW LEVEL *******************************************/
 
+// Wait up to ms (at least 1) for input and return the ms waited, so read
+// loops can count their timeout down.
+uint16_t SIM90X::waitInput(uint16_t ms) {
+#ifdef SIM90X_WAIT_INPUT
+  uint32_t start = millis();
+  SIM90X_WAIT_INPUT(mySerial, ms);
+  uint32_t waited = millis() - start;
+  // at least 1 so a port that wakes without data can't spin forever
+  return constrain(waited, (uint32_t)1, (uint32_t)ms);
+#else
+  delay(1);
+  return 1;
+#endif
+}
+
 inline int SIM90X::available(void) {
-  return mySerial->available();
+  return mySerial->SIM90X_SERIAL(available)();
 }
 
 inline size_t SIM90X::write(uint8_t x) {
-  return mySerial->write(x);
+  lasttx = millis();
+  txwrites++;
+  txbytes++;
+  return mySerial->SIM90X_SERIAL(write)(x);
+}
+
+// Hand whole buffers to the port in one call, so transparent mode bulk
+// transfers are not split into one virtual write per byte.
+size_t SIM90X::write(const uint8_t *buf, size_t size) {
+  lasttx = millis();
+  txwrites++;
+  txbytes += size;
+  return mySerial->write(buf, size);
 }
 
 inline int SIM90X::read(void) {
-  return mySerial->read();
+  int c = mySerial->SIM90X_SERIAL(read)();
+#if SIM90X_ENABLE_TCP
+  if (transparent && c >= 0)
+    closedMatch(c);
+#endif
+  return c;
 }
 
 inline int SIM90X::peek(void) {
-  return mySerial->peek();
+  return mySerial->SIM90X_SERIAL(peek)();
 }
 
 inline void SIM90X::flush() {
   mySerial->flush();
 }
 
+// True while the port carries the raw socket of TCPtransparent(): AT
+// commands are refused and nothing is read from the port.
+boolean SIM90X::dataMode(void) {
+#if SIM90X_ENABLE_TCP
+  return transparent;
+#else
+  return false;
+#endif
+}
+
 void SIM90X::flushInput() {
-    // Read all available serial input to flush pending data.
+    if (dataMode()) return;
+    // Read all available serial input to flush pending data. Only wait for
+    // 40ms of silence when the last command's final result code wasn't read,
+    // in case the rest of its reply is still on the way.
     uint16_t timeoutloop = 0;
-    while (timeoutloop++ < 40) {
-        while(available()) {
-            read();
+    uint8_t cmd = timedcmd;   // not the reply being timed
+    timedcmd = SIM90X_CMD_NONE;
+    while (true) {
+        while(mySerial->SIM90X_SERIAL(available)()) {
+#if SIM90X_ENABLE_TCP
+            if (tcprxmode == SIM90X_TCP_PUSH)
+              readline();     // don't throw away pushed TCP data
+            else
+#endif
+              mySerial->SIM90X_SERIAL(read)();
             timeoutloop = 0;  // If char was received reset the timer
         }
-        delay(1);
+        if (! pending || timeoutloop >= 40)
+            break;
+        timeoutloop += waitInput(40 - timeoutloop);
+    }
+    pending = false;
+
+    if (cmd != SIM90X_CMD_NONE) {
+      timedcmd = cmd;
+      timedstart = millis();
+    }
+}
+
+// Read the rest of the current command's reply up to its final result
+// code, returning as soon as it arrives. True if the command succeeded.
+boolean SIM90X::waitFinal(uint32_t timeout) {
+  uint32_t left = timeout;
+
+  // readline() waits 65535 ms at most, long tone strings need more
+  while (pending && left) {
+    uint16_t wait = min(left, (uint32_t)0xFFFF);
+    if (readline(wait))
+      left = timeout;
+    else
+      left -= wait;
+  }
+
+  return (! pending) && (lasterror == SIM90X_ERROR_NONE);
+}
+
+// Wait for the "> " data prompt, which isn't followed by a line end. Lines
+// before it are URCs or the error that replaces it.
+boolean SIM90X::waitPrompt(uint16_t timeout) {
+  uint16_t idx = 0;
+
+  if (dataMode()) return false;
+
+  while (timeout) {
+    if (! mySerial->SIM90X_SERIAL(available)()) {
+      timeout -= waitInput(timeout);
+      continue;
+    }
+    char c = mySerial->SIM90X_SERIAL(read)();
+    if (c == '>' && idx == 0) {
+      readRaw(1, 10);  // the space after it
+      return true;
+    }
+    if (c == '\r') continue;
+    if (c == '\n') {
+      replybuffer[idx] = 0;
+      parseError();
+      if (idx && finalResult()) return false;
+      idx = 0;
+      continue;
     }
+    if (idx < sizeof(replybuffer)-1)
+      replybuffer[idx++] = c;
+  }
+  lasterror = SIM90X_ERROR_TIMEOUT;
+  return false;
 }
 
-uint16_t SIM90X::readRaw(uint16_t b) {
+uint16_t SIM90X::readRaw(uint16_t b, uint16_t timeout) {
   uint16_t idx = 0;
 
-  while (b && (idx < sizeof(replybuffer)-1)) {
-    if (mySerial->available()) {
-      replybuffer[idx] = mySerial->read();
+  while (b && (idx < sizeof(replybuffer)-1) && timeout) {
+    if (mySerial->SIM90X_SERIAL(available)()) {
+      replybuffer[idx] = mySerial->SIM90X_SERIAL(read)();
       idx++;
       b--;
+    } else {
+      // don't hang forever when the link stops mid transfer
+      timeout -= waitInput(timeout);
     }
   }
   replybuffer[idx] = 0;
@@ -1131,23 +2883,99 @@ uint16_t SIM90X::readRaw(uint16_t b) {
   return idx;
 }
 
-uint8_t SIM90X::readline(uint16_t timeout, boolean multiline) {
+#if SIM90X_ENABLE_TCP
+// Move <len> bytes of pushed TCP data ("+IPD,<len>:<data>") from the port
+// into the local receive ring. Bytes that do not fit are dropped and
+// counted, see TCPoverflow().
+void SIM90X::readIPD(uint16_t len) {
+  uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS;
+
+  while (len && timeout) {
+    if (! mySerial->SIM90X_SERIAL(available)()) {
+      timeout -= waitInput(timeout);
+      continue;
+    }
+    uint8_t c = mySerial->SIM90X_SERIAL(read)();
+    len--;
+
+    uint16_t next = (tcprxhead + 1) % SIM90X_TCP_RXBUFFER_SIZE;
+    if (next != tcprxtail) {
+      tcprxbuff[tcprxhead] = c;
+      tcprxhead = next;
+    } else {
+      tcprxdropped++;
+    }
+  }
+}
+
+// The modem drops back to command mode with "\r\nCLOSED\r\n" when the
+// peer closes a transparent connection. Watch the bytes the sketch reads
+// for it.
+void SIM90X::closedMatch(uint8_t c) {
+  static const char closed[] PROGMEM = "\r\nCLOSED\r\n";
+
+  if (c == pgm_read_byte(closed + closedidx)) {
+    if (++closedidx == sizeof(closed)-1) {
+      transparent = false;
+      closedidx = 0;
+    }
+  } else {
+    closedidx = (c == '\r') ? 1 : 0;
+  }
+}
+#endif
+
+// Hand the line in replybuffer to the subsystem it is an unsolicited
+// result code of. True if it was one, so it isn't taken as a reply.
+boolean SIM90X::handleURC(void) {
+#if SIM90X_ENABLE_SMS
+  if (smsURC()) return true;
+#endif
+#if SIM90X_ENABLE_CALL
+  if (callURC()) return true;
+#endif
+#if SIM90X_ENABLE_TIME
+  if (timeURC()) return true;
+#endif
+  if (urccallback)
+    return urccallback(replybuffer, urcctx);
+  return false;
+}
+
+void SIM90X::setURCCallback(SIM90X_urccallback callback, void *ctx) {
+  urccallback = callback;
+  urcctx = ctx;
+}
+
+uint16_t SIM90X::readline(uint16_t timeout, boolean multiline) {
   uint16_t replyidx = 0;
 
-  while (timeout--) {
-    if (replyidx >= 254) {
+  if (dataMode()) {
+    replybuffer[0] = 0;
+    lasterror = SIM90X_ERROR_DATAMODE;
+    return 0;
+  }
+
+  while (timeout) {
+    if (replyidx >= sizeof(replybuffer)-1) {
       //Serial.println(F("SPACE"));
       break;
     }
 
-    while(mySerial->available()) {
-      char c =  mySerial->read();
+    while(mySerial->SIM90X_SERIAL(available)()) {
+      char c =  mySerial->SIM90X_SERIAL(read)();
       if (c == '\r') continue;
       if (c == 0xA) {
         if (replyidx == 0)   // the first 0x0A is ignored
           continue;
 
         if (!multiline) {
+          // unsolicited result codes can show up in the middle of any reply
+          replybuffer[replyidx] = 0;
+          if (handleURC()) {
+            replyidx = 0;
+            continue;
+          }
           timeout = 0;         // the second 0x0A is the end of the line
           break;
         }
@@ -1155,44 +2983,129 @@ uint8_t SIM90X::readline(uint16_t timeout, boolean multiline) {
       replybuffer[replyidx] = c;
       //Serial.print(c, HEX); Serial.print("#"); Serial.println(c);
       replyidx++;
+
+#if SIM90X_ENABLE_TCP
+      // pushed TCP data can show up in the middle of any reply
+      if (c == ':' && tcprxmode == SIM90X_TCP_PUSH && replyidx > 5 &&
+          strncmp_P(replybuffer, PSTR("+IPD,"), 5) == 0) {
+        replybuffer[replyidx] = 0;
+        readIPD(atoi(replybuffer+5));
+        replyidx = 0;
+      }
+#endif
     }
 
     if (timeout == 0) {
       //Serial.println(F("TIMEOUT"));
       break;
     }
-    delay(1);
+    timeout -= waitInput(timeout);
   }
   replybuffer[replyidx] = 0;  // null term
+
+  boolean failed = false;
+  if (replyidx == 0)
+    lasterror = SIM90X_ERROR_TIMEOUT;
+  else
+    failed = parseError() ||
+             (replyidx >= 4 && strcmp_P(replybuffer + replyidx - 4, PSTR("FAIL")) == 0);
+
+  if (pending && finalResult())
+    pending = false;
+
+  // a quick ERROR or SEND FAIL says nothing about how long success takes
+  if (timedcmd != SIM90X_CMD_NONE) {
+    if (! failed)
+      latencySample(timedcmd, millis() - timedstart, replyidx == 0);
+    timedcmd = SIM90X_CMD_NONE;
+  }
+
   return replyidx;
 }
 
-uint8_t SIM90X::getReply(char *send, uint16_t timeout) {
+// Record the error when replybuffer holds ERROR, +CME ERROR or +CMS ERROR.
+// True if it did.
+boolean SIM90X::parseError(void) {
+  if (strcmp_P(replybuffer, PSTR("ERROR")) == 0) {
+    lasterror = SIM90X_ERROR_ERROR;
+    lasterrorcode = 0;
+  } else if (strncmp_P(replybuffer, PSTR("+CME ERROR: "), 12) == 0) {
+    lasterror = SIM90X_ERROR_CME;
+    lasterrorcode = atoi(replybuffer+12);
+  } else if (strncmp_P(replybuffer, PSTR("+CMS ERROR: "), 12) == 0) {
+    lasterror = SIM90X_ERROR_CMS;
+    lasterrorcode = atoi(replybuffer+12);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Compare replybuffer with the expected reply. A mismatch that isn't
+// already an error is recorded as SIM90X_ERROR_UNEXPECTED.
+boolean SIM90X::checkReply(const __FlashStringHelper *reply) {
+  if (strcmp_P(replybuffer, (prog_char*)reply) == 0) return true;
+
+  if (lasterror == SIM90X_ERROR_NONE) lasterror = SIM90X_ERROR_UNEXPECTED;
+  return false;
+}
+
+boolean SIM90X::checkReply(const char *reply) {
+  if (strcmp(replybuffer, reply) == 0) return true;
+
+  if (lasterror == SIM90X_ERROR_NONE) lasterror = SIM90X_ERROR_UNEXPECTED;
+  return false;
+}
+
+// True when replybuffer holds a final result code: OK, an error, or one of
+// the results the TCP commands end with instead of OK.
+boolean SIM90X::finalResult(void) {
+  if (lasterror == SIM90X_ERROR_ERROR || lasterror == SIM90X_ERROR_CME ||
+      lasterror == SIM90X_ERROR_CMS)
+    return true;
+
+  return (strcmp_P(replybuffer, PSTR("OK")) == 0) ||
+    (strcmp_P(replybuffer, PSTR("SHUT OK")) == 0) ||
+    (strcmp_P(replybuffer, PSTR("SEND OK")) == 0) ||
+    (strcmp_P(replybuffer, PSTR("CLOSE OK")) == 0);
+}
+
+uint8_t SIM90X::getLastError(void) {
+  return lasterror;
+}
+
+uint16_t SIM90X::getLastErrorCode(void) {
+  return lasterrorcode;
+}
+
+uint16_t SIM90X::getReply(char *send, uint16_t timeout) {
   flushInput();
 
 #ifdef SIM90X_DEBUG
     Serial.print("\t---> "); Serial.println(send);
 #endif
 
-  mySerial->println(send);
+  txPrint(send);
+  txPrintln();
 
-  uint8_t l = readline(timeout);
+  uint16_t l = readline(timeout);
 #ifdef SIM90X_DEBUG
     Serial.print (F("\t<--- ")); Serial.println(replybuffer);
 #endif
   return l;
 }
 
-uint8_t SIM90X::getReply(const __FlashStringHelper *send, uint16_t timeout) {
+uint16_t SIM90X::getReply(const __FlashStringHelper *send, uint16_t timeout) {
   flushInput();
 
 #ifdef SIM90X_DEBUG
   Serial.print("\t---> "); Serial.println(send);
 #endif
 
-  mySerial->println(send);
+  txPrint(send);
+  txPrintln();
 
-  uint8_t l = readline(timeout);
+  uint16_t l = readline(timeout);
 #ifdef SIM90X_DEBUG
     Serial.print (F("\t<--- ")); Serial.println(replybuffer);
 #endif
@@ -1200,17 +3113,18 @@ uint8_t SIM90X::getReply(const __FlashStringHelper *send, uint16_t timeout) {
 }
 
 // Send prefix, suffix, and newline. Return response (and also set replybuffer with response).
-uint8_t SIM90X::getReply(const __FlashStringHelper *prefix, char *suffix, uint16_t timeout) {
+uint16_t SIM90X::getReply(const __FlashStringHelper *prefix, char *suffix, uint16_t timeout) {
   flushInput();
 
 #ifdef SIM90X_DEBUG
   Serial.print("\t---> "); Serial.print(prefix); Serial.println(suffix);
 #endif
 
-  mySerial->print(prefix);
-  mySerial->println(suffix);
+  txPrint(prefix);
+  txPrint(suffix);
+  txPrintln();
 
-  uint8_t l = readline(timeout);
+  uint16_t l = readline(timeout);
 #ifdef SIM90X_DEBUG
     Serial.print (F("\t<--- ")); Serial.println(replybuffer);
 #endif
@@ -1218,17 +3132,18 @@ uint8_t SIM90X::getReply(const __FlashStringHelper *prefix, char *suffix, uint16
 }
 
 // Send prefix, suffix, and newline. Return response (and also set replybuffer with response).
-uint8_t SIM90X::getReply(const __FlashStringHelper *prefix, int32_t suffix, uint16_t timeout) {
+uint16_t SIM90X::getReply(const __FlashStringHelper *prefix, int32_t suffix, uint16_t timeout) {
   flushInput();
 
 #ifdef SIM90X_DEBUG
   Serial.print("\t---> "); Serial.print(prefix); Serial.println(suffix, DEC);
 #endif
 
-  mySerial->print(prefix);
-  mySerial->println(suffix, DEC);
+  txPrint(prefix);
+  txPrint(suffix);
+  txPrintln();
 
-  uint8_t l = readline(timeout);
+  uint16_t l = readline(timeout);
 #ifdef SIM90X_DEBUG
     Serial.print (F("\t<--- ")); Serial.println(replybuffer);
 #endif
@@ -1236,7 +3151,7 @@ uint8_t SIM90X::getReply(const __FlashStringHelper *prefix, int32_t suffix, uint
 }
 
 // Send prefix, suffix, suffix2, and newline. Return response (and also set replybuffer with response).
-uint8_t SIM90X::getReply(const __FlashStringHelper *prefix, int32_t suffix1, int32_t suffix2, uint16_t timeout) {
+uint16_t SIM90X::getReply(const __FlashStringHelper *prefix, int32_t suffix1, int32_t suffix2, uint16_t timeout) {
   flushInput();
 
 #ifdef SIM90X_DEBUG
@@ -1244,12 +3159,13 @@ uint8_t SIM90X::getReply(const __FlashStringHelper *prefix, int32_t suffix1, int
   Serial.print(suffix1, DEC); Serial.print(","); Serial.println(suffix2, DEC);
 #endif
 
-  mySerial->print(prefix);
-  mySerial->print(suffix1);
-  mySerial->print(',');
-  mySerial->println(suffix2, DEC);
+  txPrint(prefix);
+  txPrint(suffix1);
+  txPrint(F(","));
+  txPrint(suffix2);
+  txPrintln();
 
-  uint8_t l = readline(timeout);
+  uint16_t l = readline(timeout);
 #ifdef SIM90X_DEBUG
     Serial.print (F("\t<--- ")); Serial.println(replybuffer);
 #endif
@@ -1257,7 +3173,7 @@ uint8_t SIM90X::getReply(const __FlashStringHelper *prefix, int32_t suffix1, int
 }
 
 // Send prefix, ", suffix, ", and newline. Return response (and also set replybuffer with response).
-uint8_t SIM90X::getReplyQuoted(const __FlashStringHelper *prefix, const __FlashStringHelper *suffix, uint16_t timeout) {
+uint16_t SIM90X::getReplyQuoted(const __FlashStringHelper *prefix, const __FlashStringHelper *suffix, uint16_t timeout) {
   flushInput();
 
 #ifdef SIM90X_DEBUG
@@ -1265,19 +3181,20 @@ uint8_t SIM90X::getReplyQuoted(const __FlashStringHelper *prefix, const __FlashS
   Serial.print('"'); Serial.print(suffix); Serial.println('"');
 #endif
 
-  mySerial->print(prefix);
-  mySerial->print('"');
-  mySerial->print(suffix);
-  mySerial->println('"');
+  txPrint(prefix);
+  txPrint(F("\""));
+  txPrint(suffix);
+  txPrint(F("\""));
+  txPrintln();
 
-  uint8_t l = readline(timeout);
+  uint16_t l = readline(timeout);
 #ifdef SIM90X_DEBUG
     Serial.print (F("\t<--- ")); Serial.println(replybuffer);
 #endif
   return l;
 }
 
-uint8_t SIM90X::getReplyQuoted(const __FlashStringHelper *prefix, const char *suffix, uint16_t timeout) {
+uint16_t SIM90X::getReplyQuoted(const __FlashStringHelper *prefix, const char *suffix, uint16_t timeout) {
   flushInput();
 
 #ifdef SIM90X_DEBUG
@@ -1285,12 +3202,13 @@ uint8_t SIM90X::getReplyQuoted(const __FlashStringHelper *prefix, const char *su
   Serial.print('"'); Serial.print(suffix); Serial.println('"');
 #endif
 
-  mySerial->print(prefix);
-  mySerial->print('"');
-  mySerial->print(suffix);
-  mySerial->println('"');
+  txPrint(prefix);
+  txPrint(F("\""));
+  txPrint(suffix);
+  txPrint(F("\""));
+  txPrintln();
 
-  uint8_t l = readline(timeout);
+  uint16_t l = readline(timeout);
 #ifdef SIM90X_DEBUG
     Serial.print (F("\t<--- ")); Serial.println(replybuffer);
 #endif
@@ -1302,50 +3220,50 @@ boolean SIM90X::sendCheckReply(char *send, char *reply, uint16_t timeout) {
   getReply(send, timeout);
 
 /*
-  for (uint8_t i=0; i<strlen(replybuffer); i++) {
+  for (uint16_t i=0; i<strlen(replybuffer); i++) {
     Serial.print(replybuffer[i], HEX); Serial.print(" ");
   }
   Serial.println();
-  for (uint8_t i=0; i<strlen(reply); i++) {
+  for (uint16_t i=0; i<strlen(reply); i++) {
     Serial.print(reply[i], HEX); Serial.print(" ");
   }
   Serial.println();
   */
-  return (strcmp(replybuffer, reply) == 0);
+  return checkReply(reply);
 }
 
 boolean SIM90X::sendCheckReply(const __FlashStringHelper *send, const __FlashStringHelper *reply, uint16_t timeout) {
   getReply(send, timeout);
-  return (strcmp_P(replybuffer, (prog_char*)reply) == 0);
+  return checkReply(reply);
 }
 
 // Send prefix, suffix, and newline.  Verify FONA response matches reply parameter.
 boolean SIM90X::sendCheckReply(const __FlashStringHelper *prefix, char *suffix, const __FlashStringHelper *reply, uint16_t timeout) {
   getReply(prefix, suffix, timeout);
-  return (strcmp_P(replybuffer, (prog_char*)reply) == 0);
+  return checkReply(reply);
 }
 
 // Send prefix, suffix, and newline.  Verify FONA response matches reply parameter.
 boolean SIM90X::sendCheckReply(const __FlashStringHelper *prefix, int32_t suffix, const __FlashStringHelper *reply, uint16_t timeout) {
   getReply(prefix, suffix, timeout);
-  return (strcmp_P(replybuffer, (prog_char*)reply) == 0);
+  return checkReply(reply);
 }
 
 // Send prefix, suffix, suffix2, and newline.  Verify FONA response matches reply parameter.
 boolean SIM90X::sendCheckReply(const __FlashStringHelper *prefix, int32_t suffix1, int32_t suffix2, const __FlashStringHelper *reply, uint16_t timeout) {
   getReply(prefix, suffix1, suffix2, timeout);
-  return (strcmp_P(replybuffer, (prog_char*)reply) == 0);
+  return checkReply(reply);
 }
 
 // Send prefix, ", suffix, ", and newline.  Verify FONA response matches reply parameter.
 boolean SIM90X::sendCheckReplyQuoted(const __FlashStringHelper *prefix, const __FlashStringHelper *suffix, const __FlashStringHelper *reply, uint16_t timeout) {
   getReplyQuoted(prefix, suffix, timeout);
-  return (strcmp_P(replybuffer, (prog_char*)reply) == 0);
+  return checkReply(reply);
 }
 
 boolean SIM90X::sendCheckReplyQuoted(const __FlashStringHelper *prefix, const char *suffix, const __FlashStringHelper *reply, uint16_t timeout) {
   getReplyQuoted(prefix, suffix, timeout);
-  return (strcmp_P(replybuffer, (prog_char*)reply) == 0);
+  return checkReply(reply);
 }
 
 boolean SIM90X::parseReply(const __FlashStringHelper *toreply,
@@ -1369,7 +3287,7 @@ boolean SIM90X::parseReply(const __FlashStringHelper *toreply,
 
 boolean SIM90X::parseReply(const __FlashStringHelper *toreply,
           char *v, char divider, uint8_t index) {
-  uint8_t i=0;
+  uint16_t i=0;
   char *p = strstr_P(replybuffer, (prog_char*)toreply);
   if (p == 0) return false;
   p+=strlen_P((prog_char*)toreply);
@@ -1398,7 +3316,7 @@ boolean SIM90X::parseReply(const __FlashStringHelper *toreply,
 // response.
 boolean SIM90X::parseReplyQuoted(const __FlashStringHelper *toreply,
           char *v, int maxlen, char divider, uint8_t index) {
-  uint8_t i=0, j;
+  uint16_t i=0, j;
   // Verify response starts with toreply.
   char *p = strstr_P(replybuffer, (prog_char*)toreply);
   if (p == 0) return false;
@@ -1437,7 +3355,7 @@ boolean SIM90X::sendParseReply(const __FlashStringHelper *tosend,
 
   if (! parseReply(toreply, v, divider, index)) return false;
 
-  readline(); // eat 'OK'
+  waitFinal(); // eat 'OK'
 
   return true;
 }
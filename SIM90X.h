@@ -29,6 +29,26 @@
 
 //#define SIM90X_DEBUG
 
+// Serial backend. By default the modem is driven through a Stream and every
+// byte costs a virtual call. Defining SIM90X_SERIAL_TYPE (e.g. as
+// HardwareSerial or SoftwareSerial) in the build flags makes begin() take
+// that concrete type and the per-byte read paths call it directly, so they
+// can be inlined. SIM90X_SERIAL_INCLUDE names its header if needed.
+#ifdef SIM90X_SERIAL_TYPE
+  #ifdef SIM90X_SERIAL_INCLUDE
+    #include SIM90X_SERIAL_INCLUDE
+  #endif
+  typedef SIM90X_SERIAL_TYPE SIM90X_serial_t;
+  #define SIM90X_SERIAL(fn) SIM90X_SERIAL_TYPE::fn
+#else
+  typedef Stream SIM90X_serial_t;
+  #define SIM90X_SERIAL(fn) fn
+#endif
+
+// The read loops sleep 1 ms at a time while they wait for the modem. A
+// host backend can define SIM90X_WAIT_INPUT(port, ms) to block until the
+// port is readable instead (see extras/linux).
+
 #define SIM90X_HEADSETAUDIO 0
 #define SIM90X_EXTAUDIO 1
 
@@ -48,10 +68,215 @@
 
 #define SIM90X_DEFAULT_TIMEOUT_MS 500
 
+// Footprint tiers. Define one of them (or any of the sizes below) in the
+// build flags to trade RAM for longer replies.
+#if defined(SIM90X_FOOTPRINT_SMALL)
+  #define SIM90X_REPLYBUFFER_SIZE   128
+  #define SIM90X_SENDBUFFER_SIZE    24
+  #define SIM90X_TXBUFFER_SIZE      32
+  #define SIM90X_TCP_RXBUFFER_SIZE  32
+  #define SIM90X_SMS_TEXT_SIZE      64
+  #define SIM90X_SMS_QUEUE          1
+#elif defined(SIM90X_FOOTPRINT_LARGE)
+  #define SIM90X_REPLYBUFFER_SIZE   1024
+  #define SIM90X_SENDBUFFER_SIZE    48
+  #define SIM90X_TXBUFFER_SIZE      256
+  #define SIM90X_TCP_RXBUFFER_SIZE  512
+  #define SIM90X_SMS_QUEUE          4
+#endif
+
+// modem replies, HTTPREAD/CIPRXGET/FTPGET data chunks and SMS bodies
+#ifndef SIM90X_REPLYBUFFER_SIZE
+  #define SIM90X_REPLYBUFFER_SIZE 255
+#endif
+
+// commands built around a phone number (ATD, AT+CMGS)
+#ifndef SIM90X_SENDBUFFER_SIZE
+  #define SIM90X_SENDBUFFER_SIZE 35
+#endif
+
+// outgoing commands are assembled here and sent with one write
+#ifndef SIM90X_TXBUFFER_SIZE
+  #define SIM90X_TXBUFFER_SIZE 64
+#endif
+
+// largest packet accepted by a single AT+CIPSEND
+#define SIM90X_TCP_MAX_SEND 1460
+
+// Subsystems. Set any of them to 0 in the build flags to leave its code,
+// command strings and buffers out of the build.
+#ifndef SIM90X_ENABLE_AUDIO
+  #define SIM90X_ENABLE_AUDIO 1      // volume, mic, tones and DTMF
+#endif
+#ifndef SIM90X_ENABLE_FM
+  #define SIM90X_ENABLE_FM 1         // FM radio
+#endif
+#ifndef SIM90X_ENABLE_PWM
+  #define SIM90X_ENABLE_PWM 1        // PWM buzzer
+#endif
+#ifndef SIM90X_ENABLE_CALL
+  #define SIM90X_ENABLE_CALL 1       // voice calls and caller id
+#endif
+#ifndef SIM90X_ENABLE_PHONEBOOK
+  #define SIM90X_ENABLE_PHONEBOOK 1
+#endif
+#ifndef SIM90X_ENABLE_SMS
+  #define SIM90X_ENABLE_SMS 1
+#endif
+#ifndef SIM90X_ENABLE_TIME
+  #define SIM90X_ENABLE_TIME 1       // RTC, network and NTP time
+#endif
+#ifndef SIM90X_ENABLE_TCP
+  #define SIM90X_ENABLE_TCP 1        // TCP sockets and transparent mode
+#endif
+#ifndef SIM90X_ENABLE_HTTP
+  #define SIM90X_ENABLE_HTTP 1       // HTTP(S) client and ranged downloads
+#endif
+#ifndef SIM90X_ENABLE_FTP
+  #define SIM90X_ENABLE_FTP 1        // FTP downloads
+#endif
+
+#if SIM90X_ENABLE_SMS
+  #include "SIM90X_PDU.h"
+#endif
+
+// "+++" escape guard times for transparent mode (AT+CIPMODE=1)
+#define SIM90X_ESCAPE_GUARD_BEFORE_MS 1000
+#define SIM90X_ESCAPE_GUARD_AFTER_MS  500
+
+// getLastError() values
+#define SIM90X_ERROR_NONE        0
+#define SIM90X_ERROR_TIMEOUT     1  // no reply in time
+#define SIM90X_ERROR_ERROR       2  // plain ERROR
+#define SIM90X_ERROR_CME         3  // +CME ERROR, code in getLastErrorCode()
+#define SIM90X_ERROR_CMS         4  // +CMS ERROR, code in getLastErrorCode()
+#define SIM90X_ERROR_UNEXPECTED  5  // a reply other than the expected one
+#define SIM90X_ERROR_DATAMODE    6  // not sent, the port is in transparent mode
+
+// Adaptive timeouts. The deadline of each command class below is learned
+// from the latencies of its successful replies (smoothed mean + 4 * mean
+// deviation) and kept between the class floor and cap. Set
+// SIM90X_ADAPTIVE_TIMEOUTS to 0 to always use the fixed initial values.
+#ifndef SIM90X_ADAPTIVE_TIMEOUTS
+  #define SIM90X_ADAPTIVE_TIMEOUTS 1
+#endif
+
+#define SIM90X_CMD_SMSREAD  0  // AT+CMGR
+#define SIM90X_CMD_SMSSEND  1  // +CMGS after the message body
+#define SIM90X_CMD_TCPSEND  2  // SEND OK after AT+CIPSEND data
+#define SIM90X_CMD_TCPSHUT  3  // AT+CIPSHUT
+#define SIM90X_CMD_ATTACH   4  // AT+CGATT=<0|1>
+#define SIM90X_CMD_HTTP     5  // +HTTPACTION
+#define SIM90X_CMD_CLOCK    6  // AT+CCLK?
+#define SIM90X_CMD_BEARER   7  // AT+SAPBR=<0|1>,1
+#define SIM90X_CMD_NTP      8  // +CNTP
+#define SIM90X_CMD_GSMLOC   9  // AT+CIPGSMLOC
+#define SIM90X_CMD_COUNT    10
+#define SIM90X_CMD_NONE     0xFF
+
 #define SIM90X_HTTP_GET   0
 #define SIM90X_HTTP_POST  1
 #define SIM90X_HTTP_HEAD  2 
 
+// TCP receive modes
+#define SIM90X_TCP_RXGET  0   // data is fetched with AT+CIPRXGET polling
+#define SIM90X_TCP_PUSH   1   // data is pushed as +IPD and buffered locally
+
+#ifndef SIM90X_TCP_RXBUFFER_SIZE
+  #define SIM90X_TCP_RXBUFFER_SIZE 128
+#endif
+
+// Resumable downloads
+#define SIM90X_FTP_TIMEOUT_MS    30000
+#define SIM90X_HTTP_RANGE_SIZE   4096  // bytes requested per ranged HTTPACTION
+
+// Called with every downloaded chunk, return false to abort the transfer.
+typedef boolean (*SIM90X_sink)(const uint8_t *data, uint16_t len, void *ctx);
+
+// Download progress. Start with SIM90X::downloadBegin() and keep the struct
+// (e.g. in EEPROM) to resume an interrupted transfer where it stopped.
+typedef struct {
+  uint32_t offset;  // bytes already handed to the sink
+  uint32_t crc;     // running CRC-32 of those bytes, see SIM90X::downloadCRC()
+} SIM90X_download_t;
+
+// HTTP validator cache used by HTTP_GET_cached()
+#ifndef SIM90X_HTTP_VALIDATOR_LEN
+  #define SIM90X_HTTP_VALIDATOR_LEN 32
+#endif
+
+typedef struct {
+  uint32_t key;  // CRC-32 of the URL, 0 marks an empty slot
+  char etag[SIM90X_HTTP_VALIDATOR_LEN];
+  char lastmodified[SIM90X_HTTP_VALIDATOR_LEN];
+} SIM90X_httpvalidator_t;
+
+// Modem health sampled in one exchange by getHealth()
+typedef struct {
+  uint8_t rssi;           // +CSQ, 0-31 (99 unknown)
+  uint8_t netstatus;      // +CREG, see getNetworkStatus()
+  uint8_t battpercent;    // +CBC
+  uint16_t battvoltage;   // +CBC, mV
+  uint8_t gprs;           // +CGATT, 1 when attached
+} SIM90X_health_t;
+
+// Learned latency of one command class, see getLatencyModel()
+typedef struct {
+  uint16_t srtt;    // smoothed latency in ms, 0 until the first sample
+  uint16_t rttvar;  // smoothed mean deviation in ms
+} SIM90X_latency_t;
+
+// Local clock, see getTime(). It is read from the modem (AT+CCLK?) or set
+// by network time (*PSUTTZ) and then runs on millis() between resyncs.
+#ifndef SIM90X_TIME_RESYNC_MS
+  #define SIM90X_TIME_RESYNC_MS    3600000UL
+#endif
+#define SIM90X_TIME_DRIFT_MIN_S    21600  // shortest run to measure drift over
+#define SIM90X_TIME_STEP_S         5      // larger offsets are a new time, not drift
+#define SIM90X_TIME_DRIFT_MAX_PPM  20000
+#define SIM90X_TIME_RETRY_MS       60000  // wait after a failed resync
+
+typedef struct {
+  uint8_t year;    // 0-99, from 2000
+  uint8_t month;   // 1-12
+  uint8_t day;     // 1-31
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t second;
+  int8_t tz;       // offset from UTC in quarter hours
+} SIM90X_time_t;
+
+// Tone sequences, see playDTMF(), sendDTMF() and queueTone()
+#define SIM90X_DTMF_MAX  20   // digits per command
+#ifndef SIM90X_TONE_QUEUE
+  #define SIM90X_TONE_QUEUE 8
+#endif
+
+// FM band scan, see scanFMBand()
+#define SIM90X_FM_SCAN_TIMEOUT_MS  30000
+#define SIM90X_FM_SCAN_MAX         32   // stations kept from AT+FMSCAN
+#define SIM90X_FM_BATCH            16   // AT+FMSIGNAL queries per command line
+
+typedef struct {
+  uint16_t station;  // in 100 kHz, e.g. 1011 for 101.1 MHz
+  int8_t level;
+} SIM90X_fmstation_t;
+
+// Voice call states, see getCallState()
+#define SIM90X_CALL_IDLE     0
+#define SIM90X_CALL_RINGING  1   // incoming, number known after +CLIP
+#define SIM90X_CALL_DIALING  2   // outgoing, not answered yet
+#define SIM90X_CALL_ACTIVE   3
+#define SIM90X_CALL_ENDED    4   // hung up, busy, no answer or no carrier
+
+// ring interrupts that can flag a modem of their own at the same time, see
+// callerIdNotification(); any more share one flag
+#define SIM90X_CALL_INTERRUPTS 4
+// after a ring interrupt poll() waits this long for RING and +CLIP
+#define SIM90X_RING_WAIT_MS    200
+
+typedef void (*SIM90X_callcallback)(uint8_t state, const char *number);
+
 #define SIM90X_SMS_ALL    0
 #define SIM90X_SMS_READ   1
 #define SIM90X_SMS_UNREAD 2
@@ -59,21 +284,56 @@
 #define SIM90X_SMS_UNSENT 4
 #define SIM90X_SMS_INBOX  5
 
+// Incoming SMS handed to the setSMSCallback() callback
+#ifndef SIM90X_SMS_TEXT_SIZE
+  #define SIM90X_SMS_TEXT_SIZE 161
+#endif
+// +CMT messages kept until poll(), any more are dropped (see droppedSMS())
+#ifndef SIM90X_SMS_QUEUE
+  #define SIM90X_SMS_QUEUE 2
+#endif
+#define SIM90X_SMS_STORED_MAX 4   // +CMTI indications kept until poll()
+
+typedef struct {
+  char sender[24];
+  char timestamp[24];  // "yy/MM/dd,hh:mm:ss+zz"
+  uint16_t len;
+  char text[SIM90X_SMS_TEXT_SIZE];  // null terminated, cut at SIM90X_SMS_TEXT_SIZE-1
+} SIM90X_sms_t;
+
+typedef void (*SIM90X_smscallback)(SIM90X_sms_t *sms);
+
+// Gets the lines the library doesn't handle itself, see setURCCallback()
+typedef boolean (*SIM90X_urccallback)(const char *line, void *ctx);
+
 class SIM90X : public Stream {
  public:
-  SIM90X(int8_t r = NULL);
-  boolean begin(Stream &port);
+  // r is the pin wired to the modem's RST, -1 for none
+  SIM90X(int8_t r = -1);
+  boolean begin(SIM90X_serial_t &port);
+  void poll(void);
+
+  // Hand every line that isn't a URC the library handles to callback,
+  // right as it is read. Many replies arrive after the OK of their command
+  // (CONNECT OK, +HTTPACTION, ...), so only take (return true) the lines
+  // known to be URCs; the rest are still seen as replies. The callback
+  // must not send commands.
+  void setURCCallback(SIM90X_urccallback callback, void *ctx = 0);
 
   // Stream
   int available(void);
   size_t write(uint8_t x);
+  size_t write(const uint8_t *buf, size_t size);
+  using Print::write;
   int read(void);
   int peek(void);
   void flush();
 
+#if SIM90X_ENABLE_TIME
   // RTC
   boolean enableRTC(uint8_t i);
   boolean readRTC(uint8_t *year, uint8_t *month, uint8_t *date, uint8_t *hr, uint8_t *min, uint8_t *sec);
+#endif
 
   // Battery and ADC
   boolean getADCVoltage(uint16_t *v);
@@ -85,10 +345,12 @@ class SIM90X : public Stream {
   uint8_t getSIMCCID(char *ccid);
   uint8_t getNetworkStatus(void);
   uint8_t getRSSI(void);
+  boolean getHealth(SIM90X_health_t *health);
 
   // IMEI
   uint8_t getIMEI(char *imei);
 
+#if SIM90X_ENABLE_AUDIO
   // set Audio output
   boolean setAudio(uint8_t a);
   boolean setVolume(uint8_t i);
@@ -96,29 +358,57 @@ class SIM90X : public Stream {
   boolean playToolkitTone(uint8_t t, uint16_t len);
   boolean setMicVolume(uint8_t a, uint8_t level);
   boolean playDTMF(char tone);
+  boolean playDTMF(const char *digits, uint8_t duration = 3);
+  boolean sendDTMF(const char *digits, uint8_t duration = 0);
+
+  // Queue a toolkit tone (see playToolkitTone()) of len ms, tone 0 is a
+  // pause. Queued tones are played from poll().
+  boolean queueTone(uint8_t tone, uint16_t len);
+  void clearTones(void);
+  uint8_t queuedTones(void);
+#endif
 
+#if SIM90X_ENABLE_FM
   // FM radio functions.
   boolean tuneFMradio(uint16_t station);
   boolean FMradio(boolean onoff, uint8_t a = SIM90X_HEADSETAUDIO);
   boolean setFMVolume(uint8_t i);
   int8_t getFMVolume();
   int8_t getFMSignalLevel(uint16_t station);
+  uint8_t scanFMBand(SIM90X_fmstation_t *stations, uint8_t max, int8_t minlevel = 0);
+  boolean tuneFMStrongest(void);
+#endif
 
+#if SIM90X_ENABLE_SMS
   // SMS handling
   boolean setSMSInterrupt(uint8_t i);
   uint8_t getSMSInterrupt(void);
   int8_t getNumSMS(void);
   boolean readSMS(uint8_t i, char *smsbuff, uint16_t max, uint16_t *readsize);
   boolean sendSMS(char *smsaddr, char *smsmsg);
+  boolean sendSMS(char *smsaddr, char *smsmsg, uint8_t *mr);
+  boolean setSMSLinkHold(uint8_t mode);
+  // PDU mode: any payload, split into concatenated parts when needed
+  boolean sendSMS(char *smsaddr, const uint8_t *data, uint16_t len, uint8_t dcs);
+  boolean readSMS(uint8_t i, SIM90X_pdu_t *msg);
   boolean deleteSMS(uint8_t i);
   boolean getSMSSender(uint8_t i, char *sender, int senderlen);
   boolean deleteSMSs(uint8_t typ = SIM90X_SMS_ALL);
   uint8_t hasSMS(uint8_t type);
+  boolean setSMSCallback(SIM90X_smscallback callback);
+  uint16_t droppedSMS(void);
+#endif
 
+#if SIM90X_ENABLE_TIME
   // Time
   boolean enableNetworkTimeSync(boolean onoff);
   boolean enableNTPTimeSync(boolean onoff, const __FlashStringHelper *ntpserver=0);
   boolean getTime(char *buff, uint16_t maxlen);
+  boolean getTime(SIM90X_time_t *t);
+  uint32_t getUnixTime(void);
+  boolean syncTime(void);
+  void setTimeResync(uint32_t ms);
+#endif
 
   // GPRS handling
   boolean enableGPRS(boolean onoff);
@@ -127,14 +417,29 @@ class SIM90X : public Stream {
   void setGPRSNetworkSettings(const __FlashStringHelper *apn, const __FlashStringHelper *username=0, const __FlashStringHelper *password=0);
   void setGPRSNetworkSettings(char *apn, char *username = 0, char *password = 0);
 
+#if SIM90X_ENABLE_TCP
   // TCP raw connections
-  boolean TCPconnect(char *server, uint16_t port);
+  boolean TCPconnect(char *server, uint16_t port, uint8_t rxmode = SIM90X_TCP_RXGET);
   boolean TCPclose(void);
   boolean TCPconnected(void);
-  boolean TCPsend(char *packet, uint8_t len);
+  boolean TCPsend(char *packet, uint16_t len);
   uint16_t TCPavailable(void);
-  uint16_t TCPread(uint8_t *buff, uint8_t len);
+  uint16_t TCPread(uint8_t *buff, uint16_t len);
+  // pushed bytes dropped because the receive buffer was full, since
+  // TCPconnect()
+  uint32_t TCPoverflow(void);
+
+  // TCP transparent mode: once connected the SIM90X Stream is the raw socket.
+  // AT commands fail with SIM90X_ERROR_DATAMODE until TCPescape() or until
+  // the modem reports the connection CLOSED.
+  boolean TCPtransparent(char *server, uint16_t port);
+  boolean TCPescape(void);
+  boolean TCPresume(void);
+  boolean TCPtransparentClose(void);
+  boolean isTransparent(void);
+#endif
 
+#if SIM90X_ENABLE_HTTP
   // HTTP low level interface (maps directly to SIM800 commands).
   boolean HTTP_init();
   boolean HTTP_term();
@@ -144,9 +449,11 @@ class SIM90X : public Stream {
   boolean HTTP_para(const __FlashStringHelper *parameter, const __FlashStringHelper *value);
   boolean HTTP_para(const __FlashStringHelper *parameter, int32_t value);
   boolean HTTP_data(uint32_t size, uint32_t maxTime=10000);
-  boolean HTTP_action(uint8_t method, uint16_t *status, uint16_t *datalen, int32_t timeout = 10000);
+  boolean HTTP_action(uint8_t method, uint16_t *status, uint16_t *datalen, int32_t timeout = 0);
+  boolean HTTP_action(uint8_t method, uint16_t *status, uint32_t *datalen, int32_t timeout = 0);
   boolean HTTP_readall(uint16_t *datalen);
   boolean HTTP_ssl(boolean onoff);
+  boolean HTTP_header(const __FlashStringHelper *name, char *value, uint16_t maxlen);
 
   // HTTP high level interface (easier to use, less flexible).
   boolean HTTP_GET_start(char *url, uint16_t *status, uint16_t *datalen);
@@ -155,12 +462,32 @@ class SIM90X : public Stream {
   void HTTP_POST_end(void);
   void setUserAgent(const __FlashStringHelper *useragent);
 
+  // Conditional GET: the cache is caller owned so it can be persisted
+  // (e.g. saved to EEPROM) across resets.
+  void setHTTPCache(SIM90X_httpvalidator_t *cache, uint8_t entries);
+  boolean HTTP_GET_cached(char *url, uint16_t *status, uint16_t *datalen);
+
   // HTTPS
   void setHTTPSRedirect(boolean onoff);
+#endif
+
+  // Resumable downloads over FTP (AT+FTPGET) and ranged HTTP GET.
+#if SIM90X_ENABLE_FTP
+  boolean FTP_setup(const char *server, uint16_t port = 21, const char *user = 0, const char *pass = 0);
+  boolean FTP_download(const char *path, const char *file, SIM90X_download_t *progress, SIM90X_sink sink, void *ctx = 0);
+#endif
+#if SIM90X_ENABLE_HTTP
+  boolean HTTP_download(char *url, SIM90X_download_t *progress, SIM90X_sink sink, void *ctx = 0);
+#endif
+  static void downloadBegin(SIM90X_download_t *progress);
+  static uint32_t downloadCRC(const SIM90X_download_t *progress);
 
+#if SIM90X_ENABLE_PWM
   // PWM (buzzer)
   boolean setPWM(uint16_t period, uint8_t duty = 50);
+#endif
 
+#if SIM90X_ENABLE_CALL
   // Phone calls
   boolean callPhone(char *phonenum);
   boolean hangUp(void);
@@ -168,40 +495,200 @@ class SIM90X : public Stream {
   boolean callerIdNotification(boolean enable, uint8_t interrupt = 0);
   boolean incomingCallNumber(char* phonenum);
 
+  // Call state machine, fed by RING/+CLIP/+COLP/+CLCC and the result
+  // codes ending a call as poll() sees them.
+  boolean setCallCallback(SIM90X_callcallback callback);
+  uint8_t getCallState(void);
+  uint8_t queryCallState(void);
+#endif
+
+  // Bytes and port writes sent so far (commands and data).
+  void getTXStats(uint32_t *bytes, uint32_t *writes);
+  void resetTXStats(void);
+
+  // Why the last command failed (SIM90X_ERROR_*) and the numeric
+  // +CME/+CMS error code reported by the modem.
+  uint8_t getLastError(void);
+  uint16_t getLastErrorCode(void);
+
+  // Copy the learned latencies (SIM90X_CMD_COUNT entries) out, e.g. to keep
+  // them in EEPROM, and back in after a reset.
+  void getLatencyModel(SIM90X_latency_t *model);
+  void setLatencyModel(const SIM90X_latency_t *model);
+  uint16_t getTimeout(uint8_t cmd);
+
   // Helper functions to verify responses.
   boolean expectReply(const __FlashStringHelper *reply, uint16_t timeout = 10000);
   boolean sendCheckReply(char *send, char *reply, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
   boolean sendCheckReply(const __FlashStringHelper *send, const __FlashStringHelper *reply, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
 
+#if SIM90X_ENABLE_PHONEBOOK
   // Phone Book
   boolean getPhonebook(uint8_t addr, char *number, int number_length, char *name, int name_length);
   boolean getPhonebookNumber(uint8_t i, char *number, int length);
   boolean getPhonebookName(uint8_t i, char *name, int length);
   uint8_t hasPhonebookNumber(char *number);
+#endif
 
  private:
   int8_t _rstpin;
 
-  char replybuffer[255];
+  char replybuffer[SIM90X_REPLYBUFFER_SIZE];
   char *apn;
   char *apnusername;
   char *apnpassword;
+  uint32_t lasttx;
+
+  char txbuffer[SIM90X_TXBUFFER_SIZE];
+  uint16_t txlen;
+  uint32_t txbytes;
+  uint32_t txwrites;
+
+  uint8_t lasterror;
+  uint16_t lasterrorcode;
+  boolean pending;  // the final result code of the last command wasn't read yet
+
+  SIM90X_latency_t latency[SIM90X_CMD_COUNT];
+  uint8_t timedcmd;      // class of the reply being timed, SIM90X_CMD_NONE if none
+  uint32_t timedstart;
+
+#if SIM90X_ENABLE_TCP
+  boolean transparent;
+  uint8_t closedidx;    // bytes of "\r\nCLOSED\r\n" seen in data mode
+  uint8_t tcprxmode;
+  uint8_t tcprxbuff[SIM90X_TCP_RXBUFFER_SIZE];
+  uint16_t tcprxhead;
+  uint16_t tcprxtail;
+  uint32_t tcprxdropped;
+#endif
+
+#if SIM90X_ENABLE_TIME
+  boolean timeset;
+  uint32_t timeutc;     // UTC seconds since 2000 at the last sync
+  uint32_t timems;      // millis() at the last sync
+  int8_t timetz;
+  int16_t timedrift;    // ppm millis() runs slow
+  uint32_t timedriftutc;  // reference time and millis() the drift is
+  uint32_t timedriftms;   // measured from
+  uint32_t timeresync;
+  boolean timefailed;   // the last resync failed...
+  uint32_t timetried;   // ...at this millis()
+#endif
+
+#if SIM90X_ENABLE_AUDIO
+  struct {
+    uint8_t tone;
+    uint16_t len;
+  } tonequeue[SIM90X_TONE_QUEUE];
+  uint8_t tonehead;
+  uint8_t tonecount;
+  uint32_t tonestart;   // millis() the playing tone started
+  uint16_t tonelen;
+#endif
+
+#if SIM90X_ENABLE_CALL
+  uint8_t callstate;
+  char callnumber[24];
+  boolean callchanged;   // callcallback is due from poll()
+  boolean callreported;  // incomingCallNumber() returned this call
+  boolean callseen;      // AT+CLCC listed a call
+  SIM90X_callcallback callcallback;
+#endif
+
+#if SIM90X_ENABLE_SMS
+  SIM90X_smscallback smscallback;
+  SIM90X_sms_t smsin[SIM90X_SMS_QUEUE];  // +CMT messages not delivered yet
+  uint8_t smshead;
+  uint8_t smscount;
+  uint16_t smsdropped;
+  SIM90X_sms_t smsread; // a message read back from storage
+  boolean smsdelivering;
+  uint8_t smsstored[SIM90X_SMS_STORED_MAX];
+  uint8_t smsstoredcount;
+  uint8_t smsref;       // concatenation reference of the last PDU mode message
+  boolean smstext;      // AT+CMGF=1 is known to be set
+#endif
+
+#if SIM90X_ENABLE_HTTP
   boolean httpsredirect;
   const __FlashStringHelper *useragent;
+  SIM90X_httpvalidator_t *httpcache;
+  uint8_t httpcachesize;
+  uint8_t httpcachenext;
 
   // HTTP helpers
   boolean HTTP_setup(char *url);
+  void HTTP_para_begin(const __FlashStringHelper *parameter, boolean quoted);
+  boolean HTTP_read(uint32_t start, uint16_t len, uint16_t *readlen);
+  boolean HTTP_validators(SIM90X_httpvalidator_t *validator);
+  SIM90X_httpvalidator_t *HTTP_cacheEntry(uint32_t key, boolean create);
+#endif
 
+  // download helpers
+  boolean downloadChunk(SIM90X_download_t *progress, SIM90X_sink sink, void *ctx, uint16_t len);
+
+  void txPut(char c);
+  void txPrint(const char *s);
+  void txPrint(const __FlashStringHelper *s);
+  void txPrint(int32_t v);
+  void txPrintln(void);
+  void txFlush(void);
+  void txWrite(const uint8_t *buf, uint16_t len);
+
+  boolean parseError(void);
+  boolean finalResult(void);
+  boolean checkReply(const __FlashStringHelper *reply);
+  boolean checkReply(const char *reply);
+
+  boolean dataMode(void);
   void flushInput();
-  uint16_t readRaw(uint16_t b);
-  uint8_t readline(uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS, boolean multiline = false);
-  uint8_t getReply(char *send, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
-  uint8_t getReply(const __FlashStringHelper *send, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
-  uint8_t getReply(const __FlashStringHelper *prefix, char *suffix, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
-  uint8_t getReply(const __FlashStringHelper *prefix, int32_t suffix, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
-  uint8_t getReply(const __FlashStringHelper *prefix, int32_t suffix1, int32_t suffix2, uint16_t timeout); // Don't set default value or else function call is ambiguous.
-  uint8_t getReplyQuoted(const __FlashStringHelper *prefix, const __FlashStringHelper *suffix, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
-  uint8_t getReplyQuoted(const __FlashStringHelper *prefix, const char *suffix, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
+  uint16_t waitInput(uint16_t ms);
+  boolean waitFinal(uint32_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
+  uint16_t timeoutFor(uint8_t cmd);
+  void latencySample(uint8_t cmd, uint16_t ms, boolean timedout);
+  uint16_t readRaw(uint16_t b, uint16_t timeout = 1000);
+  boolean waitPrompt(uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
+#if SIM90X_ENABLE_TCP
+  void readIPD(uint16_t len);
+  void closedMatch(uint8_t c);
+#endif
+#if SIM90X_ENABLE_SMS
+  boolean smsURC(void);
+  uint16_t smsHeader(const char *p, uint8_t first, SIM90X_sms_t *sms);
+  void readSMSText(uint16_t len, SIM90X_sms_t *sms);
+  boolean readStoredSMS(uint8_t i);
+  void smsDeliver(void);
+  boolean sendPDU(const uint8_t *tpdu, uint8_t len);
+  boolean smsTextMode(void);
+  uint16_t readHex(void);
+#endif
+#if SIM90X_ENABLE_FM
+  void FMsignals(const uint16_t *freqs, uint8_t count,
+                 SIM90X_fmstation_t *stations, uint8_t *n, uint8_t max,
+                 int8_t minlevel);
+#endif
+  boolean handleURC(void);
+#if SIM90X_ENABLE_TIME
+  boolean timeURC(void);
+  void setClock(uint32_t utc);
+  uint32_t clockNow(void);
+#endif
+#if SIM90X_ENABLE_AUDIO
+  void txDTMF(const char *digits);
+  void toneNext(void);
+#endif
+#if SIM90X_ENABLE_CALL
+  boolean callURC(void);
+  void setCallState(uint8_t state);
+#endif
+  uint16_t readline(uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS, boolean multiline = false);
+  uint16_t getReply(char *send, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
+  uint16_t getReply(const __FlashStringHelper *send, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
+  uint16_t getReply(const __FlashStringHelper *prefix, char *suffix, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
+  uint16_t getReply(const __FlashStringHelper *prefix, int32_t suffix, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
+  uint16_t getReply(const __FlashStringHelper *prefix, int32_t suffix1, int32_t suffix2, uint16_t timeout); // Don't set default value or else function call is ambiguous.
+  uint16_t getReplyQuoted(const __FlashStringHelper *prefix, const __FlashStringHelper *suffix, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
+  uint16_t getReplyQuoted(const __FlashStringHelper *prefix, const char *suffix, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
 
   boolean sendCheckReply(const __FlashStringHelper *prefix, char *suffix, const __FlashStringHelper *reply, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
   boolean sendCheckReply(const __FlashStringHelper *prefix, int32_t suffix, const __FlashStringHelper *reply, uint16_t timeout = SIM90X_DEFAULT_TIMEOUT_MS);
@@ -221,10 +708,27 @@ class SIM90X : public Stream {
        const __FlashStringHelper *toreply,
        uint16_t *v, char divider = ',', uint8_t index=0);
 
-  static boolean _incomingCall;
-  static void onIncomingCall();
+#if SIM90X_ENABLE_CALL
+  // Each ring interrupt takes a slot with its own ISR, which flags the
+  // modem it was attached for. With every slot taken the ISR sets the
+  // shared flag instead. poll() takes the flag as a hint to wait for the
+  // RING and +CLIP that update callstate.
+  volatile boolean _incomingCall;
+  static volatile boolean _incomingCallShared;
+  static SIM90X *_callirq[SIM90X_CALL_INTERRUPTS];
+  static uint8_t _callirqnum[SIM90X_CALL_INTERRUPTS];
+  template <uint8_t i> static void onIncomingCall() {
+    if (_callirq[i]) _callirq[i]->_incomingCall = true;
+  }
+  static void onIncomingCallShared() {
+    _incomingCallShared = true;
+  }
+#endif
+
+  SIM90X_urccallback urccallback;
+  void *urcctx;
 
-  Stream *mySerial;
+  SIM90X_serial_t *mySerial;
 };
 
 #endif
@@ -0,0 +1,170 @@
+/***************************************************
+  Arduino Client interface on top of the SIM90X TCP functions.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include "SIM90X_Client.h"
+
+#if SIM90X_ENABLE_TCP
+
+SIM90XClient::SIM90XClient(SIM90X &modem, uint8_t rxmode)
+{
+  this->modem = &modem;
+  this->rxmode = rxmode;
+  isconnected = false;
+  statustime = 0;
+  txlen = 0;
+  txtime = 0;
+  rxlen = 0;
+  rxpos = 0;
+}
+
+int SIM90XClient::connect(IPAddress ip, uint16_t port) {
+  char host[16];
+
+  sprintf_P(host, PSTR("%u.%u.%u.%u"), ip[0], ip[1], ip[2], ip[3]);
+  return connect(host, port);
+}
+
+int SIM90XClient::connect(const char *host, uint16_t port) {
+  txlen = 0;
+  rxlen = rxpos = 0;
+
+  isconnected = modem->TCPconnect((char *)host, port, rxmode);
+  statustime = millis();
+  return isconnected ? 1 : 0;
+}
+
+/********* TX **********************************************************/
+
+size_t SIM90XClient::write(uint8_t b) {
+  return write(&b, 1);
+}
+
+size_t SIM90XClient::write(const uint8_t *buf, size_t size) {
+  size_t written = 0;
+
+  if (! isconnected) return 0;
+
+  // nothing to coalesce with: big writes go out directly
+  if (txlen == 0 && size >= SIM90X_CLIENT_TXBUFFER_SIZE) {
+    return send(buf, size) ? size : 0;
+  }
+
+  while (written < size) {
+    uint16_t n = min((size_t)(SIM90X_CLIENT_TXBUFFER_SIZE - txlen), size - written);
+    memcpy(txbuff + txlen, buf + written, n);
+    txlen += n;
+    written += n;
+
+    if (txlen == SIM90X_CLIENT_TXBUFFER_SIZE) {
+      if (! send(txbuff, txlen)) {
+        txlen = 0;
+        return written - n;
+      }
+      txlen = 0;
+    }
+  }
+
+  txtime = millis();
+  return written;
+}
+
+void SIM90XClient::flush(void) {
+  if (txlen == 0) return;
+
+  send(txbuff, txlen);
+  txlen = 0;
+}
+
+// Split writes larger than a single AT+CIPSEND accepts.
+boolean SIM90XClient::send(const uint8_t *buf, size_t size) {
+  while (size) {
+    uint16_t n = min(size, (size_t)SIM90X_TCP_MAX_SEND);
+    if (! modem->TCPsend((char *)buf, n)) {
+      isconnected = false;
+      return false;
+    }
+    buf += n;
+    size -= n;
+  }
+  return true;
+}
+
+void SIM90XClient::checkFlushTimer(void) {
+  if (txlen && (millis() - txtime >= SIM90X_CLIENT_FLUSH_MS))
+    flush();
+}
+
+/********* RX **********************************************************/
+
+// Refill the RX buffer with a single buffer-sized TCPread().
+uint16_t SIM90XClient::fill(void) {
+  if (rxpos < rxlen) return rxlen - rxpos;
+
+  rxpos = 0;
+  rxlen = modem->TCPread(rxbuff, SIM90X_CLIENT_RXBUFFER_SIZE);
+  return rxlen;
+}
+
+int SIM90XClient::available(void) {
+  if (! isconnected) return 0;
+
+  checkFlushTimer();
+  return fill();
+}
+
+int SIM90XClient::read(void) {
+  uint8_t b;
+
+  if (read(&b, 1) != 1) return -1;
+  return b;
+}
+
+int SIM90XClient::read(uint8_t *buf, size_t size) {
+  size_t n = 0;
+
+  checkFlushTimer();
+  while (n < size && fill()) {
+    uint16_t chunk = min((size_t)(rxlen - rxpos), size - n);
+    memcpy(buf + n, rxbuff + rxpos, chunk);
+    rxpos += chunk;
+    n += chunk;
+  }
+
+  return n ? n : -1;
+}
+
+int SIM90XClient::peek(void) {
+  if (! fill()) return -1;
+  return rxbuff[rxpos];
+}
+
+/********* CONNECTION **************************************************/
+
+void SIM90XClient::stop(void) {
+  flush();
+  modem->TCPclose();
+  isconnected = false;
+  rxlen = rxpos = 0;
+}
+
+uint8_t SIM90XClient::connected(void) {
+  // buffered data can still be read after the peer closed
+  if (rxpos < rxlen) return 1;
+  if (! isconnected) return 0;
+
+  checkFlushTimer();
+
+  if (millis() - statustime >= SIM90X_CLIENT_STATUS_MS) {
+    isconnected = modem->TCPconnected();
+    statustime = millis();
+  }
+  return isconnected ? 1 : 0;
+}
+
+SIM90XClient::operator bool(void) {
+  return isconnected;
+}
+
+#endif
@@ -0,0 +1,76 @@
+/***************************************************
+  Arduino Client interface on top of the SIM90X TCP functions, so that
+  MQTT, HTTP and TLS libraries written against Client can run over the
+  SIM90X modem.
+
+  Writes are coalesced in a small TX buffer and sent with one AT+CIPSEND
+  when the buffer is full, on flush() or after SIM90X_CLIENT_FLUSH_MS of
+  write inactivity. Reads are served from an RX buffer filled with
+  buffer-sized TCPread() calls.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_CLIENT_H
+#define SIM90X_CLIENT_H
+
+#include "SIM90X.h"
+#include <Client.h>
+
+#if SIM90X_ENABLE_TCP
+
+#ifndef SIM90X_CLIENT_TXBUFFER_SIZE
+  #define SIM90X_CLIENT_TXBUFFER_SIZE 64
+#endif
+
+#ifndef SIM90X_CLIENT_RXBUFFER_SIZE
+  #define SIM90X_CLIENT_RXBUFFER_SIZE 64
+#endif
+
+// pending TX data is sent after this much write inactivity (Nagle-style)
+#ifndef SIM90X_CLIENT_FLUSH_MS
+  #define SIM90X_CLIENT_FLUSH_MS 20
+#endif
+
+// minimum interval between AT+CIPSTATUS queries made by connected()
+#define SIM90X_CLIENT_STATUS_MS 1000
+
+class SIM90XClient : public Client {
+ public:
+  SIM90XClient(SIM90X &modem, uint8_t rxmode = SIM90X_TCP_RXGET);
+
+  int connect(IPAddress ip, uint16_t port);
+  int connect(const char *host, uint16_t port);
+  size_t write(uint8_t b);
+  size_t write(const uint8_t *buf, size_t size);
+  using Print::write;
+  int available(void);
+  int read(void);
+  int read(uint8_t *buf, size_t size);
+  int peek(void);
+  void flush(void);
+  void stop(void);
+  uint8_t connected(void);
+  operator bool(void);
+
+ private:
+  SIM90X *modem;
+  uint8_t rxmode;
+  boolean isconnected;
+  uint32_t statustime;
+
+  uint8_t txbuff[SIM90X_CLIENT_TXBUFFER_SIZE];
+  uint16_t txlen;
+  uint32_t txtime;
+
+  uint8_t rxbuff[SIM90X_CLIENT_RXBUFFER_SIZE];
+  uint16_t rxlen;
+  uint16_t rxpos;
+
+  boolean send(const uint8_t *buf, size_t size);
+  void checkFlushTimer(void);
+  uint16_t fill(void);
+};
+
+#endif // SIM90X_ENABLE_TCP
+
+#endif
@@ -0,0 +1,390 @@
+/***************************************************
+  Minimal MQTT 3.1.1 client for a persistent SIM90X TCP connection.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include "SIM90X_MQTT.h"
+
+// room reserved in front of a packet for the fixed header
+#define SIM90X_MQTT_HEADER 5
+
+SIM90XMQTT::SIM90XMQTT(Client &client)
+{
+  this->client = &client;
+  callback = 0;
+  keepalive = SIM90X_MQTT_KEEPALIVE_S;
+  nextid = 0;
+  pingoutstanding = false;
+  pingsent = 0;
+  lastout = lastin = 0;
+  truncated = false;
+  droppedpackets = 0;
+  arenalen = 0;
+  numinflight = 0;
+}
+
+void SIM90XMQTT::setCallback(SIM90X_MQTT_callback callback) {
+  this->callback = callback;
+}
+
+void SIM90XMQTT::setKeepAlive(uint16_t seconds) {
+  keepalive = seconds;
+}
+
+uint8_t SIM90XMQTT::inflight(void) {
+  return numinflight;
+}
+
+uint16_t SIM90XMQTT::dropped(void) {
+  return droppedpackets;
+}
+
+/********* SESSION *****************************************************/
+
+boolean SIM90XMQTT::connect(const char *host, uint16_t port, const char *clientid,
+                            const char *user, const char *pass) {
+  if (! client->connect(host, port)) return false;
+
+  uint16_t pos = SIM90X_MQTT_HEADER;
+  uint8_t flags = 0x02;  // clean session
+  if (user) flags |= 0x80;
+  if (pass) flags |= 0x40;
+
+  // protocol name "MQTT", level 4 (3.1.1)
+  buffer[pos++] = 0;
+  buffer[pos++] = 4;
+  buffer[pos++] = 'M';
+  buffer[pos++] = 'Q';
+  buffer[pos++] = 'T';
+  buffer[pos++] = 'T';
+  buffer[pos++] = 4;
+  buffer[pos++] = flags;
+  buffer[pos++] = keepalive >> 8;
+  buffer[pos++] = keepalive & 0xFF;
+
+  pos = writeString(clientid, pos);
+  if (pos && user) pos = writeString(user, pos);
+  if (pos && pass) pos = writeString(pass, pos);
+  if (! pos) {
+    client->stop();
+    return false;
+  }
+
+  // a clean session drops whatever was in flight
+  numinflight = 0;
+  arenalen = 0;
+  pingoutstanding = false;
+
+  if (! sendPacket(buffer, finishPacket(SIM90X_MQTT_CONNECT, pos - SIM90X_MQTT_HEADER))) {
+    client->stop();
+    return false;
+  }
+
+  uint16_t len;
+  uint8_t header = readPacket(&len, SIM90X_MQTT_TIMEOUT_MS);
+  // CONNACK: session present flag, return code (0 is accepted)
+  if ((header & 0xF0) != SIM90X_MQTT_CONNACK || len < 2 || buffer[1] != 0) {
+    client->stop();
+    return false;
+  }
+
+  return true;
+}
+
+void SIM90XMQTT::disconnect(void) {
+  uint8_t packet[2] = { SIM90X_MQTT_DISCONNECT, 0 };
+
+  sendPacket(packet, 2);
+  client->stop();
+}
+
+boolean SIM90XMQTT::connected(void) {
+  return client->connected();
+}
+
+boolean SIM90XMQTT::loop(void) {
+  if (! connected()) return false;
+
+  uint32_t now = millis();
+
+  if (keepalive) {
+    uint32_t interval = keepalive * 1000UL;
+    if (pingoutstanding) {
+      // no PINGRESP within a whole keepalive period: the link is dead
+      if (now - pingsent >= interval) {
+        client->stop();
+        return false;
+      }
+    } else if ((now - lastout >= interval) || (now - lastin >= interval)) {
+      uint8_t packet[2] = { SIM90X_MQTT_PINGREQ, 0 };
+      if (! sendPacket(packet, 2)) return false;
+      pingsent = now;
+      pingoutstanding = true;
+    }
+  }
+
+  while (client->available()) {
+    uint16_t len;
+    uint8_t header = readPacket(&len, SIM90X_MQTT_TIMEOUT_MS);
+    if (! header) break;
+    handlePacket(header, len);
+  }
+
+  retransmit();
+
+  return connected();
+}
+
+/********* PUBLISH / SUBSCRIBE *****************************************/
+
+boolean SIM90XMQTT::publish(const char *topic, const char *payload, uint8_t qos, boolean retain) {
+  return publish(topic, (const uint8_t *)payload, strlen(payload), qos, retain);
+}
+
+boolean SIM90XMQTT::publish(const char *topic, const uint8_t *payload, uint16_t len,
+                            uint8_t qos, boolean retain) {
+  if (! connected()) return false;
+  if (qos > 1) qos = 1;
+
+  uint16_t pos = writeString(topic, SIM90X_MQTT_HEADER);
+  if (! pos) return false;
+
+  uint16_t id = 0;
+  if (qos) {
+    id = packetId();
+    buffer[pos++] = id >> 8;
+    buffer[pos++] = id & 0xFF;
+  }
+
+  if (pos + len > SIM90X_MQTT_MAX_PACKET_SIZE) return false;
+  memcpy(buffer + pos, payload, len);
+  pos += len;
+
+  uint8_t header = SIM90X_MQTT_PUBLISH | (qos << 1) | (retain ? 1 : 0);
+  uint16_t total = finishPacket(header, pos - SIM90X_MQTT_HEADER);
+
+  if (qos) {
+    // keep a copy until the broker PUBACKs it
+    if (numinflight == SIM90X_MQTT_MAX_INFLIGHT ||
+        arenalen + total > SIM90X_MQTT_ARENA_SIZE)
+      return false;
+
+    memcpy(arena + arenalen, buffer, total);
+    inflighttable[numinflight].id = id;
+    inflighttable[numinflight].offset = arenalen;
+    inflighttable[numinflight].len = total;
+    inflighttable[numinflight].sent = millis();
+    arenalen += total;
+    numinflight++;
+  }
+
+  if (! sendPacket(buffer, total)) {
+    // the caller sees the failure, don't retransmit it behind its back
+    if (qos) releaseInflight(id);
+    return false;
+  }
+  return true;
+}
+
+boolean SIM90XMQTT::subscribe(const char *topic, uint8_t qos) {
+  if (! connected()) return false;
+  if (qos > 1) qos = 1;
+
+  uint16_t pos = SIM90X_MQTT_HEADER;
+  uint16_t id = packetId();
+  buffer[pos++] = id >> 8;
+  buffer[pos++] = id & 0xFF;
+
+  pos = writeString(topic, pos);
+  if (! pos || pos >= SIM90X_MQTT_MAX_PACKET_SIZE) return false;
+  buffer[pos++] = qos;
+
+  // SUBSCRIBE has a fixed 0b0010 flags nibble
+  if (! sendPacket(buffer, finishPacket(SIM90X_MQTT_SUBSCRIBE | 0x02, pos - SIM90X_MQTT_HEADER)))
+    return false;
+
+  // SUBACK: packet id, granted QoS (0x80 is failure)
+  if (! waitFor(SIM90X_MQTT_SUBACK, id)) return false;
+  return buffer[2] != 0x80;
+}
+
+/********* IN-FLIGHT TABLE *********************************************/
+
+void SIM90XMQTT::releaseInflight(uint16_t id) {
+  for (uint8_t i=0; i<numinflight; i++) {
+    if (inflighttable[i].id != id) continue;
+
+    uint16_t offset = inflighttable[i].offset;
+    uint16_t len = inflighttable[i].len;
+
+    // compact the arena and the table
+    memmove(arena + offset, arena + offset + len, arenalen - offset - len);
+    arenalen -= len;
+    for (uint8_t j=i; j+1<numinflight; j++) {
+      inflighttable[j] = inflighttable[j+1];
+      inflighttable[j].offset -= len;
+    }
+    numinflight--;
+    return;
+  }
+}
+
+void SIM90XMQTT::retransmit(void) {
+  for (uint8_t i=0; i<numinflight; i++) {
+    if (millis() - inflighttable[i].sent < SIM90X_MQTT_RETRY_MS) continue;
+
+    uint8_t *packet = arena + inflighttable[i].offset;
+    packet[0] |= 0x08;  // DUP
+    sendPacket(packet, inflighttable[i].len);
+    inflighttable[i].sent = millis();
+  }
+}
+
+/********* PACKET I/O **************************************************/
+
+uint16_t SIM90XMQTT::packetId(void) {
+  if (++nextid == 0) nextid = 1;
+  return nextid;
+}
+
+// Append a length-prefixed UTF-8 string at pos. Returns the new position
+// or 0 if it doesn't fit.
+uint16_t SIM90XMQTT::writeString(const char *s, uint16_t pos) {
+  uint16_t len = strlen(s);
+
+  if (pos + 2 + len > SIM90X_MQTT_MAX_PACKET_SIZE) return 0;
+
+  buffer[pos++] = len >> 8;
+  buffer[pos++] = len & 0xFF;
+  memcpy(buffer + pos, s, len);
+  return pos + len;
+}
+
+// Put the fixed header in front of the len bytes built at
+// SIM90X_MQTT_HEADER and move the packet to the start of the buffer.
+// Returns the total packet length.
+uint16_t SIM90XMQTT::finishPacket(uint8_t header, uint16_t len) {
+  uint8_t hdr[SIM90X_MQTT_HEADER];
+  uint8_t n = 0;
+  uint16_t remaining = len;
+
+  hdr[n++] = header;
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    if (remaining) digit |= 0x80;
+    hdr[n++] = digit;
+  } while (remaining);
+
+  memmove(buffer + n, buffer + SIM90X_MQTT_HEADER, len);
+  memcpy(buffer, hdr, n);
+  return n + len;
+}
+
+boolean SIM90XMQTT::sendPacket(const uint8_t *packet, uint16_t len) {
+  boolean ok = (client->write(packet, len) == len);
+
+  // one packet, one AT+CIPSEND
+  client->flush();
+  lastout = millis();
+  return ok;
+}
+
+uint8_t SIM90XMQTT::readByte(uint8_t *b, uint32_t deadline) {
+  while (! client->available()) {
+    if ((int32_t)(millis() - deadline) >= 0) return 0;
+    if (! client->connected()) return 0;
+  }
+  *b = client->read();
+  return 1;
+}
+
+// Read one packet into the buffer (without the fixed header). Returns the
+// fixed header byte, or 0 on timeout. Of a packet that doesn't fit the
+// buffer only the start is kept, and truncated is set.
+uint8_t SIM90XMQTT::readPacket(uint16_t *len, uint32_t timeout) {
+  uint32_t deadline = millis() + timeout;
+  uint8_t header, digit;
+  uint32_t remaining = 0;
+  uint32_t multiplier = 1;
+
+  if (! readByte(&header, deadline)) return 0;
+
+  do {
+    if (! readByte(&digit, deadline)) return 0;
+    remaining += (digit & 0x7F) * multiplier;
+    multiplier *= 128;
+  } while ((digit & 0x80) && multiplier <= 128UL*128*128);
+
+  *len = 0;
+  truncated = (remaining > SIM90X_MQTT_MAX_PACKET_SIZE);
+  while (remaining--) {
+    uint8_t b;
+    if (! readByte(&b, deadline)) return 0;
+    if (*len < SIM90X_MQTT_MAX_PACKET_SIZE)
+      buffer[(*len)++] = b;
+  }
+
+  lastin = millis();
+  return header;
+}
+
+void SIM90XMQTT::handlePacket(uint8_t header, uint16_t len) {
+  if (truncated) droppedpackets++;
+
+  switch (header & 0xF0) {
+    case SIM90X_MQTT_PUBLISH: {
+      if (len < 2) break;
+
+      uint8_t qos = (header >> 1) & 0x03;
+      uint16_t topiclen = (buffer[0] << 8) | buffer[1];
+      uint16_t start = 2 + topiclen + (qos ? 2 : 0);
+      if (start > len) break;
+
+      if (qos) {
+        uint16_t id = (buffer[2 + topiclen] << 8) | buffer[3 + topiclen];
+        uint8_t packet[4] = { SIM90X_MQTT_PUBACK, 2, (uint8_t)(id >> 8), (uint8_t)(id & 0xFF) };
+        sendPacket(packet, 4);
+      }
+
+      // acknowledged so the broker doesn't resend it, but not delivered
+      if (truncated) break;
+
+      // shift the topic down to null terminate it in place
+      memmove(buffer, buffer + 2, topiclen);
+      buffer[topiclen] = 0;
+
+      if (callback)
+        callback((char *)buffer, buffer + start, len - start);
+      break;
+    }
+    case SIM90X_MQTT_PUBACK: {
+      if (len >= 2)
+        releaseInflight((buffer[0] << 8) | buffer[1]);
+      break;
+    }
+    case SIM90X_MQTT_PINGRESP: {
+      pingoutstanding = false;
+      break;
+    }
+  }
+}
+
+// Wait for a packet of the given type and packet id, handling anything
+// else that arrives in the meantime.
+uint8_t SIM90XMQTT::waitFor(uint8_t type, uint16_t id) {
+  uint32_t start = millis();
+
+  while (millis() - start < SIM90X_MQTT_TIMEOUT_MS) {
+    uint16_t len;
+    uint8_t header = readPacket(&len, SIM90X_MQTT_TIMEOUT_MS - (millis() - start));
+    if (! header) return 0;
+
+    if ((header & 0xF0) == type && len >= 2 &&
+        ((buffer[0] << 8) | buffer[1]) == id)
+      return header;
+
+    handlePacket(header, len);
+  }
+  return 0;
+}
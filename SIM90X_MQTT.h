@@ -0,0 +1,114 @@
+/***************************************************
+  Minimal MQTT 3.1.1 client for a persistent SIM90X TCP connection.
+
+  Supports CONNECT, PUBLISH (QoS 0 and 1), SUBSCRIBE and PINGREQ
+  keepalive. All packets are built in a fixed-size buffer; outgoing
+  QoS 1 messages are kept in a fixed-size arena, tracked in a small
+  in-flight table and retransmitted with the DUP flag until PUBACKed.
+
+  The client runs over any Arduino Client, normally a SIM90XClient.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_MQTT_H
+#define SIM90X_MQTT_H
+
+#if (ARDUINO >= 100)
+  #include "Arduino.h"
+#else
+  #include "WProgram.h"
+#endif
+#include <Client.h>
+
+// largest packet that can be sent or received
+#ifndef SIM90X_MQTT_MAX_PACKET_SIZE
+  #define SIM90X_MQTT_MAX_PACKET_SIZE 128
+#endif
+
+// room for unacknowledged outgoing QoS 1 packets
+#ifndef SIM90X_MQTT_ARENA_SIZE
+  #define SIM90X_MQTT_ARENA_SIZE 128
+#endif
+
+#ifndef SIM90X_MQTT_MAX_INFLIGHT
+  #define SIM90X_MQTT_MAX_INFLIGHT 4
+#endif
+
+#define SIM90X_MQTT_KEEPALIVE_S   60
+#define SIM90X_MQTT_TIMEOUT_MS    10000
+#define SIM90X_MQTT_RETRY_MS      10000
+
+#define SIM90X_MQTT_CONNECT     0x10
+#define SIM90X_MQTT_CONNACK     0x20
+#define SIM90X_MQTT_PUBLISH     0x30
+#define SIM90X_MQTT_PUBACK      0x40
+#define SIM90X_MQTT_SUBSCRIBE   0x80
+#define SIM90X_MQTT_SUBACK      0x90
+#define SIM90X_MQTT_PINGREQ     0xC0
+#define SIM90X_MQTT_PINGRESP    0xD0
+#define SIM90X_MQTT_DISCONNECT  0xE0
+
+typedef void (*SIM90X_MQTT_callback)(char *topic, uint8_t *payload, uint16_t len);
+
+class SIM90XMQTT {
+ public:
+  SIM90XMQTT(Client &client);
+
+  boolean connect(const char *host, uint16_t port, const char *clientid,
+                  const char *user = 0, const char *pass = 0);
+  void disconnect(void);
+  boolean connected(void);
+
+  boolean publish(const char *topic, const uint8_t *payload, uint16_t len,
+                  uint8_t qos = 0, boolean retain = false);
+  boolean publish(const char *topic, const char *payload, uint8_t qos = 0, boolean retain = false);
+  boolean subscribe(const char *topic, uint8_t qos = 0);
+
+  // Process incoming packets, keepalive and QoS 1 retransmissions.
+  // Call it often from loop(). Returns false once the session is lost.
+  boolean loop(void);
+
+  void setCallback(SIM90X_MQTT_callback callback);
+  void setKeepAlive(uint16_t seconds);
+  uint8_t inflight(void);
+  // incoming packets over SIM90X_MQTT_MAX_PACKET_SIZE, skipped (QoS 1
+  // messages are still acknowledged)
+  uint16_t dropped(void);
+
+ private:
+  Client *client;
+  SIM90X_MQTT_callback callback;
+  uint16_t keepalive;
+  uint16_t nextid;
+  boolean pingoutstanding;
+  uint32_t pingsent;
+  uint32_t lastout;
+  uint32_t lastin;
+
+  uint8_t buffer[SIM90X_MQTT_MAX_PACKET_SIZE];
+  boolean truncated;    // the packet in buffer didn't fit
+  uint16_t droppedpackets;
+
+  uint8_t arena[SIM90X_MQTT_ARENA_SIZE];
+  uint16_t arenalen;
+  struct {
+    uint16_t id;
+    uint16_t offset;
+    uint16_t len;
+    uint32_t sent;
+  } inflighttable[SIM90X_MQTT_MAX_INFLIGHT];
+  uint8_t numinflight;
+
+  uint16_t packetId(void);
+  boolean sendPacket(const uint8_t *packet, uint16_t len);
+  uint16_t finishPacket(uint8_t header, uint16_t len);
+  uint16_t writeString(const char *s, uint16_t pos);
+  uint8_t readByte(uint8_t *b, uint32_t deadline);
+  uint8_t readPacket(uint16_t *len, uint32_t timeout);
+  void handlePacket(uint8_t type, uint16_t len);
+  uint8_t waitFor(uint8_t type, uint16_t id);
+  void releaseInflight(uint16_t id);
+  void retransmit(void);
+};
+
+#endif
@@ -0,0 +1,176 @@
+/***************************************************
+  Multi-modem manager for SIM90X.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include "SIM90X_Manager.h"
+
+SIM90XManager::SIM90XManager()
+{
+  callback = 0;
+  count = 0;
+  nextid = 0;
+  nextorder = 0;
+  memset(jobs, 0, sizeof(jobs));
+}
+
+void SIM90XManager::setCallback(SIM90X_Manager_callback callback) {
+  this->callback = callback;
+}
+
+uint8_t SIM90XManager::modems(void) {
+  return count;
+}
+
+uint8_t SIM90XManager::load(uint8_t i) {
+  lock();
+  uint8_t n = slots[i].load;
+  unlock();
+  return n;
+}
+
+uint8_t SIM90XManager::rssi(uint8_t i) {
+  lock();
+  uint8_t r = slots[i].rssi;
+  unlock();
+  return r;
+}
+
+int8_t SIM90XManager::add(SIM90X &modem) {
+  lock();
+  if (count == SIM90X_MANAGER_MODEMS) {
+    unlock();
+    return -1;
+  }
+  uint8_t i = count;
+  slots[i].modem = &modem;
+  slots[i].load = 0;
+  slots[i].rssi = 0;
+  slots[i].registered = false;
+  slots[i].sampled = false;
+  slots[i].healthat = 0;
+  count++;
+  unlock();
+
+  sampleHealth(i);
+  return i;
+}
+
+// Refresh the signal and registration of modem i when they are due.
+void SIM90XManager::sampleHealth(uint8_t i) {
+  SIM90X_health_t health;
+
+  lock();
+  boolean due = ! slots[i].sampled ||
+                millis() - slots[i].healthat >= SIM90X_MANAGER_HEALTH_MS;
+  unlock();
+  if (! due) return;
+
+  boolean ok = slots[i].modem->getHealth(&health);
+
+  lock();
+  slots[i].sampled = true;
+  slots[i].healthat = millis();
+  slots[i].registered = ok && (health.netstatus == 1 || health.netstatus == 5);
+  slots[i].rssi = (ok && health.rssi != 99) ? health.rssi : 0;
+  unlock();
+}
+
+// The modem with the least work, weighed against its signal. Registered
+// modems go first. Called with the lock held.
+int8_t SIM90XManager::pick(int8_t except) {
+  boolean anyregistered = false;
+  int8_t best = -1;
+  uint16_t bestscore = 0;
+
+  for (uint8_t i=0; i<count; i++)
+    if (i != except && slots[i].registered) anyregistered = true;
+
+  for (uint8_t i=0; i<count; i++) {
+    if (i == except || (anyregistered && ! slots[i].registered)) continue;
+
+    uint16_t score = slots[i].load * SIM90X_MANAGER_LOAD_WEIGHT + (31 - min(slots[i].rssi, (uint8_t)31));
+    if (best < 0 || score < bestscore) {
+      best = i;
+      bestscore = score;
+    }
+  }
+  return best;
+}
+
+uint16_t SIM90XManager::submit(SIM90X_job job, void *ctx) {
+  uint8_t j;
+
+  lock();
+  for (j=0; j<SIM90X_MANAGER_JOBS && jobs[j].job; j++) ;
+  int8_t i = pick(-1);
+  if (j == SIM90X_MANAGER_JOBS || i < 0) {
+    unlock();
+    return 0;
+  }
+
+  if (++nextid == 0) nextid = 1;
+  jobs[j].job = job;
+  jobs[j].ctx = ctx;
+  jobs[j].id = nextid;
+  jobs[j].order = nextorder++;
+  jobs[j].modem = i;
+  jobs[j].tries = 0;
+  jobs[j].running = false;
+  slots[i].load++;
+  uint16_t id = nextid;
+  unlock();
+
+  wake(i);
+  return id;
+}
+
+boolean SIM90XManager::service(uint8_t i) {
+  SIM90X *modem = slots[i].modem;
+  int8_t j = -1;
+
+  modem->poll();
+  sampleHealth(i);
+
+  // the oldest job queued on this modem
+  lock();
+  for (uint8_t k=0; k<SIM90X_MANAGER_JOBS; k++) {
+    if (! jobs[k].job || jobs[k].running || jobs[k].modem != i) continue;
+    if (j < 0 || (int32_t)(jobs[k].order - jobs[j].order) < 0) j = k;
+  }
+  if (j < 0) {
+    unlock();
+    return false;
+  }
+  jobs[j].running = true;
+  SIM90X_job job = jobs[j].job;
+  void *ctx = jobs[j].ctx;
+  uint16_t id = jobs[j].id;
+  unlock();
+
+  boolean ok = job(*modem, ctx);
+
+  lock();
+  jobs[j].running = false;
+  slots[i].load--;
+  if (! ok && ++jobs[j].tries < SIM90X_MANAGER_TRIES) {
+    // try another modem, keeping its place in the queue
+    int8_t k = pick(i);
+    if (k < 0) k = i;
+    jobs[j].modem = k;
+    slots[k].load++;
+    unlock();
+    wake(k);
+    return true;
+  }
+  jobs[j].job = 0;
+  unlock();
+
+  if (callback) callback(id, ok, i, ctx);
+  return true;
+}
+
+void SIM90XManager::loop(void) {
+  for (uint8_t i=0; i<count; i++)
+    service(i);
+}
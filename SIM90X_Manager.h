@@ -0,0 +1,102 @@
+/***************************************************
+  Multi-modem manager for SIM90X.
+
+  Runs jobs (send an SMS, an HTTP request, a TCP exchange...) on several
+  modems. Each job goes to the modem with the least work queued, ties and
+  near ties going to the better signal; the signal and registration of
+  every modem are sampled with getHealth() every SIM90X_MANAGER_HEALTH_MS.
+  A job that fails is moved to another modem, up to
+  SIM90X_MANAGER_TRIES times.
+
+  loop() serves the modems in turn from one thread. A host can instead
+  give every modem a thread of its own that calls service(i); see
+  extras/linux/SIM90XThreadedManager.h.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_MANAGER_H
+#define SIM90X_MANAGER_H
+
+#include "SIM90X.h"
+
+#ifndef SIM90X_MANAGER_MODEMS
+  #define SIM90X_MANAGER_MODEMS 4
+#endif
+
+// jobs queued or running at the same time
+#ifndef SIM90X_MANAGER_JOBS
+  #define SIM90X_MANAGER_JOBS 16
+#endif
+
+#define SIM90X_MANAGER_TRIES        3
+#define SIM90X_MANAGER_HEALTH_MS    30000
+// a queued job weighs as much as this many steps of RSSI (2 dB each)
+#define SIM90X_MANAGER_LOAD_WEIGHT  8
+
+// Runs on the modem the manager picked. Return false if it failed.
+typedef boolean (*SIM90X_job)(SIM90X &modem, void *ctx);
+// Reports the result of job <id> and the modem it ran on last.
+typedef void (*SIM90X_Manager_callback)(uint16_t id, boolean ok, uint8_t modem, void *ctx);
+
+class SIM90XManager {
+ public:
+  SIM90XManager();
+  virtual ~SIM90XManager() {}
+
+  // Add a modem that begin() succeeded on. Returns its index, -1 if all
+  // SIM90X_MANAGER_MODEMS are taken.
+  virtual int8_t add(SIM90X &modem);
+
+  // Queue job with ctx (which must stay valid until the callback). Returns
+  // its id, 0 if SIM90X_MANAGER_JOBS are queued already.
+  uint16_t submit(SIM90X_job job, void *ctx);
+
+  // Serve every modem once: poll it and run its next job. Call it often
+  // from loop().
+  void loop(void);
+
+  // Serve modem i once. Returns true if it ran a job.
+  boolean service(uint8_t i);
+
+  void setCallback(SIM90X_Manager_callback callback);
+  uint8_t modems(void);
+  uint8_t load(uint8_t i);     // jobs queued or running on modem i
+  uint8_t rssi(uint8_t i);     // last sampled, 0 when unknown
+
+ protected:
+  // A threaded manager guards the tables with a lock and wakes the
+  // thread serving a modem when a job is queued for it.
+  virtual void lock(void) {}
+  virtual void unlock(void) {}
+  virtual void wake(uint8_t i) { (void)i; }
+
+ private:
+  SIM90X_Manager_callback callback;
+
+  struct {
+    SIM90X *modem;
+    uint8_t load;
+    uint8_t rssi;
+    boolean registered;
+    boolean sampled;
+    uint32_t healthat;     // millis() of the last getHealth()
+  } slots[SIM90X_MANAGER_MODEMS];
+  uint8_t count;
+
+  struct {
+    SIM90X_job job;        // 0 marks a free entry
+    void *ctx;
+    uint16_t id;
+    uint32_t order;        // queue order on the modem
+    uint8_t modem;
+    uint8_t tries;
+    boolean running;
+  } jobs[SIM90X_MANAGER_JOBS];
+  uint16_t nextid;
+  uint32_t nextorder;
+
+  int8_t pick(int8_t except);
+  void sampleHealth(uint8_t i);
+};
+
+#endif
@@ -0,0 +1,284 @@
+/***************************************************
+  Persistent outbound queue for SIM90X.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include "SIM90X_Outbox.h"
+
+#if SIM90X_OUTBOX_EEPROM
+  #include <EEPROM.h>
+#endif
+#if SIM90X_OUTBOX_FILE
+  #include <stdio.h>
+  #include <unistd.h>
+#endif
+
+// Frame: magic, state, seq (4), len (2), payload, CRC-16 of seq..payload.
+// The state byte is left out of the CRC so it can be rewritten alone.
+#define SIM90X_OUTBOX_MAGIC    0xA5
+#define SIM90X_OUTBOX_PENDING  0x01
+#define SIM90X_OUTBOX_SENT     0x00
+
+// CRC-16/CCITT-FALSE
+static uint16_t crc16_update(uint16_t crc, const uint8_t *data, uint16_t len) {
+  while (len--) {
+    crc ^= (uint16_t)*data++ << 8;
+    for (uint8_t k=0; k<8; k++)
+      crc = (crc << 1) ^ (0x1021 & (0 - (crc >> 15)));
+  }
+  return crc;
+}
+
+/********* STORAGE BACKENDS ***********************************************/
+
+#if SIM90X_OUTBOX_EEPROM
+
+SIM90XEEPROMStore::SIM90XEEPROMStore(uint16_t base, uint16_t len)
+{
+  this->base = base;
+  this->len = len;
+}
+
+uint16_t SIM90XEEPROMStore::size(void) {
+  return len;
+}
+
+void SIM90XEEPROMStore::read(uint16_t addr, uint8_t *buf, uint16_t len) {
+  while (len--)
+    *buf++ = EEPROM.read(base + addr++);
+}
+
+void SIM90XEEPROMStore::write(uint16_t addr, const uint8_t *buf, uint16_t len) {
+  while (len--) {
+#ifdef __AVR__
+    EEPROM.update(base + addr++, *buf++);  // spares unchanged cells
+#else
+    EEPROM.write(base + addr++, *buf++);
+#endif
+  }
+}
+
+void SIM90XEEPROMStore::commit(void) {
+#if defined(ESP8266) || defined(ESP32)
+  EEPROM.commit();
+#endif
+}
+
+#endif
+
+#if SIM90X_OUTBOX_FILE
+
+SIM90XFileStore::SIM90XFileStore(const char *path, uint16_t len)
+{
+  this->len = len;
+  file = fopen(path, "r+b");
+  if (file == 0) {
+    file = fopen(path, "w+b");
+    for (uint16_t i=0; file && i<len; i++)
+      fputc(0xFF, (FILE *)file);
+  }
+}
+
+SIM90XFileStore::~SIM90XFileStore() {
+  if (file) fclose((FILE *)file);
+}
+
+uint16_t SIM90XFileStore::size(void) {
+  return file ? len : 0;
+}
+
+void SIM90XFileStore::read(uint16_t addr, uint8_t *buf, uint16_t len) {
+  fseek((FILE *)file, addr, SEEK_SET);
+  uint16_t n = fread(buf, 1, len, (FILE *)file);
+  memset(buf + n, 0xFF, len - n);
+}
+
+void SIM90XFileStore::write(uint16_t addr, const uint8_t *buf, uint16_t len) {
+  fseek((FILE *)file, addr, SEEK_SET);
+  fwrite(buf, 1, len, (FILE *)file);
+}
+
+void SIM90XFileStore::commit(void) {
+  fflush((FILE *)file);
+  fsync(fileno((FILE *)file));
+}
+
+#endif
+
+/********* OUTBOX *********************************************************/
+
+SIM90XOutbox::SIM90XOutbox(SIM90XStore &store)
+{
+  this->store = &store;
+  sender = 0;
+  ctx = 0;
+  head = tail = 0;
+  count = 0;
+  seq = 0;
+  nextseq = 1;
+  waiting = false;
+  retryat = 0;
+}
+
+void SIM90XOutbox::setSender(SIM90X_Outbox_sender sender, void *ctx) {
+  this->sender = sender;
+  this->ctx = ctx;
+}
+
+uint16_t SIM90XOutbox::pending(void) {
+  return count;
+}
+
+void SIM90XOutbox::kick(void) {
+  waiting = false;
+}
+
+// Read the frame at addr, its payload into record. Returns the frame
+// length, 0 if there is no intact frame.
+uint16_t SIM90XOutbox::readFrame(uint16_t addr, uint32_t *seq, uint8_t *state, uint16_t *len) {
+  uint8_t hdr[8];
+  uint8_t crc[2];
+
+  if ((uint32_t)addr + SIM90X_OUTBOX_OVERHEAD > store->size()) return 0;
+  store->read(addr, hdr, 8);
+  if (hdr[0] != SIM90X_OUTBOX_MAGIC) return 0;
+
+  *len = hdr[6] | (uint16_t)hdr[7] << 8;
+  if (*len > SIM90X_OUTBOX_RECORD_SIZE ||
+      (uint32_t)addr + SIM90X_OUTBOX_OVERHEAD + *len > store->size())
+    return 0;
+
+  store->read(addr + 8, record, *len);
+  store->read(addr + 8 + *len, crc, 2);
+  uint16_t c = crc16_update(0xFFFF, hdr + 2, 6);
+  c = crc16_update(c, record, *len);
+  if (c != (crc[0] | (uint16_t)crc[1] << 8)) return 0;
+
+  *state = hdr[1];
+  *seq = hdr[2] | (uint32_t)hdr[3] << 8 | (uint32_t)hdr[4] << 16 | (uint32_t)hdr[5] << 24;
+  return *len + SIM90X_OUTBOX_OVERHEAD;
+}
+
+// The log is written in sequence order and wraps to 0 when a record
+// doesn't fit before the end. The oldest pending record is the head, the
+// end of the newest record the tail.
+void SIM90XOutbox::begin(void) {
+  uint32_t maxseq = 0;
+  uint32_t minseq = 0xFFFFFFFFUL;
+  uint16_t addr = 0;
+
+  count = 0;
+  head = tail = 0;
+  while ((uint32_t)addr + SIM90X_OUTBOX_OVERHEAD <= store->size()) {
+    uint32_t s;
+    uint8_t state;
+    uint16_t len;
+    uint16_t n = readFrame(addr, &s, &state, &len);
+
+    if (! n) {
+      addr++;  // torn or overwritten, look for the next frame
+      continue;
+    }
+    if (s >= maxseq) {
+      maxseq = s;
+      tail = addr + n;
+    }
+    if (state == SIM90X_OUTBOX_PENDING) {
+      count++;
+      if (s < minseq) {
+        minseq = s;
+        head = addr;
+      }
+    }
+    addr += n;
+  }
+
+  nextseq = maxseq + 1;
+  seq = minseq;
+  if (! count) head = tail;
+}
+
+boolean SIM90XOutbox::add(const uint8_t *data, uint16_t len) {
+  uint16_t n = len + SIM90X_OUTBOX_OVERHEAD;
+  uint16_t size = store->size();
+  uint16_t addr;
+
+  if (len > SIM90X_OUTBOX_RECORD_SIZE || n > size) return false;
+
+  // free room runs from the tail to the head, around the end
+  if (! count || tail > head) {
+    if ((uint32_t)tail + n <= size)
+      addr = tail;
+    else if (! count || n <= head)
+      addr = 0;
+    else
+      return false;
+  } else {
+    if ((uint32_t)tail + n > head) return false;
+    addr = tail;
+  }
+
+  uint8_t hdr[8];
+  hdr[0] = SIM90X_OUTBOX_MAGIC;
+  hdr[1] = SIM90X_OUTBOX_PENDING;
+  hdr[2] = nextseq;
+  hdr[3] = nextseq >> 8;
+  hdr[4] = nextseq >> 16;
+  hdr[5] = nextseq >> 24;
+  hdr[6] = len;
+  hdr[7] = len >> 8;
+  uint16_t c = crc16_update(0xFFFF, hdr + 2, 6);
+  c = crc16_update(c, data, len);
+  uint8_t crc[2] = { (uint8_t)c, (uint8_t)(c >> 8) };
+
+  store->write(addr, hdr, 8);
+  store->write(addr + 8, data, len);
+  store->write(addr + 8 + len, crc, 2);
+  store->commit();
+
+  if (! count) {
+    head = addr;
+    seq = nextseq;
+  }
+  nextseq++;
+  tail = addr + n;
+  count++;
+  return true;
+}
+
+void SIM90XOutbox::loop(void) {
+  if (! count || ! sender) return;
+  if (waiting && (int32_t)(millis() - retryat) < 0) return;
+  waiting = false;
+
+  for (uint8_t i=0; i<SIM90X_OUTBOX_BATCH && count; i++) {
+    uint32_t s;
+    uint8_t state;
+    uint16_t len;
+    uint16_t n = readFrame(head, &s, &state, &len);
+
+    // the next record follows the last one, or starts over at 0
+    if (! n || s != seq) {
+      head = 0;
+      n = readFrame(head, &s, &state, &len);
+    }
+    if (! n || s != seq) {
+      begin();  // damaged, find what is left
+      return;
+    }
+
+    if (! sender(record, len, ctx)) {
+      waiting = true;
+      retryat = millis() + SIM90X_OUTBOX_RETRY_MS;
+      return;
+    }
+
+    uint8_t sent = SIM90X_OUTBOX_SENT;
+    store->write(head + 1, &sent, 1);
+    store->commit();
+
+    count--;
+    seq++;
+    head = count ? head + n : tail;
+  }
+}
@@ -0,0 +1,136 @@
+/***************************************************
+  Persistent outbound queue for SIM90X.
+
+  Payloads that can't be sent now (no coverage, bearer down, reboot) are
+  appended to a log kept in a storage backend: EEPROM on the device, a
+  file on a host. Records are framed with a CRC-16 and written around a
+  ring, so a torn write is skipped when the log is scanned again after a
+  reset. loop() hands the oldest records to the sender callback, a batch
+  at a time, and marks each one sent with a single byte write.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_OUTBOX_H
+#define SIM90X_OUTBOX_H
+
+#if (ARDUINO >= 100)
+  #include "Arduino.h"
+#else
+  #include "WProgram.h"
+#endif
+
+// EEPROM backend on the MCUs that have the Arduino EEPROM library
+#ifndef SIM90X_OUTBOX_EEPROM
+  #if defined(__AVR__) || defined(ESP8266) || defined(ESP32)
+    #define SIM90X_OUTBOX_EEPROM 1
+  #else
+    #define SIM90X_OUTBOX_EEPROM 0
+  #endif
+#endif
+
+// file backend on hosts
+#ifndef SIM90X_OUTBOX_FILE
+  #if defined(__linux__) || defined(__APPLE__)
+    #define SIM90X_OUTBOX_FILE 1
+  #else
+    #define SIM90X_OUTBOX_FILE 0
+  #endif
+#endif
+
+// largest payload of one record
+#ifndef SIM90X_OUTBOX_RECORD_SIZE
+  #define SIM90X_OUTBOX_RECORD_SIZE 128
+#endif
+
+#define SIM90X_OUTBOX_BATCH     8       // records sent per loop()
+#define SIM90X_OUTBOX_RETRY_MS  10000   // wait after the sender failed
+#define SIM90X_OUTBOX_OVERHEAD  10      // frame bytes around a payload
+
+// Where the log lives. Addresses run from 0 to size()-1.
+class SIM90XStore {
+ public:
+  virtual uint16_t size(void) = 0;
+  virtual void read(uint16_t addr, uint8_t *buf, uint16_t len) = 0;
+  virtual void write(uint16_t addr, const uint8_t *buf, uint16_t len) = 0;
+  // make the writes so far survive a reset
+  virtual void commit(void) {}
+};
+
+#if SIM90X_OUTBOX_EEPROM
+// len bytes of EEPROM from base. On ESP8266/ESP32 call EEPROM.begin()
+// first with room for them.
+class SIM90XEEPROMStore : public SIM90XStore {
+ public:
+  SIM90XEEPROMStore(uint16_t base, uint16_t len);
+  uint16_t size(void);
+  void read(uint16_t addr, uint8_t *buf, uint16_t len);
+  void write(uint16_t addr, const uint8_t *buf, uint16_t len);
+  void commit(void);
+
+ private:
+  uint16_t base;
+  uint16_t len;
+};
+#endif
+
+#if SIM90X_OUTBOX_FILE
+// A file of len bytes, created when it doesn't exist.
+class SIM90XFileStore : public SIM90XStore {
+ public:
+  SIM90XFileStore(const char *path, uint16_t len);
+  ~SIM90XFileStore();
+  uint16_t size(void);
+  void read(uint16_t addr, uint8_t *buf, uint16_t len);
+  void write(uint16_t addr, const uint8_t *buf, uint16_t len);
+  void commit(void);
+
+ private:
+  void *file;
+  uint16_t len;
+};
+#endif
+
+// Send one record, return false to keep it and retry later.
+typedef boolean (*SIM90X_Outbox_sender)(const uint8_t *data, uint16_t len, void *ctx);
+
+class SIM90XOutbox {
+ public:
+  SIM90XOutbox(SIM90XStore &store);
+
+  // Scan the log for the records left by the last run. Call it once
+  // before anything else.
+  void begin(void);
+
+  // Append a record. Returns false if it is too long or the log is full.
+  boolean add(const uint8_t *data, uint16_t len);
+
+  // Send up to SIM90X_OUTBOX_BATCH records back to back. Call it often
+  // from loop(); after a failure it waits SIM90X_OUTBOX_RETRY_MS.
+  void loop(void);
+
+  // Retry now, e.g. once the bearer is back up.
+  void kick(void);
+
+  void setSender(SIM90X_Outbox_sender sender, void *ctx = 0);
+  uint16_t pending(void);
+
+ private:
+  SIM90XStore *store;
+  SIM90X_Outbox_sender sender;
+  void *ctx;
+
+  uint16_t head;       // oldest unsent record
+  uint16_t tail;       // where the next record goes
+  uint16_t count;
+  uint32_t seq;        // of the record at head
+  uint32_t nextseq;
+
+  boolean waiting;
+  uint32_t retryat;
+
+  uint8_t record[SIM90X_OUTBOX_RECORD_SIZE];
+
+  uint16_t readFrame(uint16_t addr, uint32_t *seq, uint8_t *state, uint16_t *len);
+};
+
+#endif
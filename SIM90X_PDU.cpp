@@ -0,0 +1,410 @@
+/***************************************************
+  PDU-mode SMS codec for SIM90X.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include <avr/pgmspace.h>
+
+#include "SIM90X_PDU.h"
+
+#define SIM90X_PDU_ESC  0x1B
+
+// GSM 03.38 default alphabet to Latin-1, 0 where Latin-1 has no such
+// character (Greek capitals). Also searched backwards to encode.
+static const uint8_t gsm7[128] PROGMEM = {
+  '@',  0xA3, '$',  0xA5, 0xE8, 0xE9, 0xF9, 0xEC,   // 0x00
+  0xF2, 0xC7, '\n', 0xD8, 0xF8, '\r', 0xC5, 0xE5,
+  0,    '_',  0,    0,    0,    0,    0,    0,      // 0x10
+  0,    0,    0,    0,    0xC6, 0xE6, 0xDF, 0xC9,
+  ' ',  '!',  '"',  '#',  0xA4, '%',  '&',  '\'',   // 0x20
+  '(',  ')',  '*',  '+',  ',',  '-',  '.',  '/',
+  '0',  '1',  '2',  '3',  '4',  '5',  '6',  '7',    // 0x30
+  '8',  '9',  ':',  ';',  '<',  '=',  '>',  '?',
+  0xA1, 'A',  'B',  'C',  'D',  'E',  'F',  'G',    // 0x40
+  'H',  'I',  'J',  'K',  'L',  'M',  'N',  'O',
+  'P',  'Q',  'R',  'S',  'T',  'U',  'V',  'W',    // 0x50
+  'X',  'Y',  'Z',  0xC4, 0xD6, 0xD1, 0xDC, 0xA7,
+  0xBF, 'a',  'b',  'c',  'd',  'e',  'f',  'g',    // 0x60
+  'h',  'i',  'j',  'k',  'l',  'm',  'n',  'o',
+  'p',  'q',  'r',  's',  't',  'u',  'v',  'w',    // 0x70
+  'x',  'y',  'z',  0xE4, 0xF6, 0xF1, 0xFC, 0xE0,
+};
+
+// Extension table, characters sent as ESC + code
+static const uint8_t gsm7ext[][2] PROGMEM = {
+  { 0x0A, 0x0C }, { 0x14, '^' }, { 0x28, '{' }, { 0x29, '}' }, { 0x2F, '\\' },
+  { 0x3C, '[' },  { 0x3D, '~' }, { 0x3E, ']' }, { 0x40, '|' },
+};
+
+#define GSM7EXT_COUNT (sizeof(gsm7ext) / sizeof(gsm7ext[0]))
+
+// Put the 7-bit value v at bit offset bit of ud (zeroed beforehand).
+static void pack7(uint8_t *ud, uint16_t bit, uint8_t v) {
+  uint8_t shift = bit % 8;
+
+  ud[bit/8] |= v << shift;
+  if (shift > 1)
+    ud[bit/8 + 1] |= v >> (8 - shift);
+}
+
+static uint8_t unpack7(const uint8_t *ud, uint16_t bit) {
+  uint8_t shift = bit % 8;
+  uint8_t v = ud[bit/8] >> shift;
+
+  if (shift > 1)
+    v |= ud[bit/8 + 1] << (8 - shift);
+  return v & 0x7F;
+}
+
+// Septets the header of a concatenated part takes, fill bits included
+static uint16_t udhSeptets(uint8_t udhl) {
+  return (udhl * 8 + 6) / 7;
+}
+
+/********* ALPHABET ****************************************************/
+
+// Codes for Latin-1 character c in code[], returns how many (1 or 2).
+// Characters the alphabet doesn't have become '?'.
+uint8_t SIM90XPDU::toGSM7(uint8_t c, uint8_t *code) {
+  if (c) {
+    for (uint8_t i=0; i<128; i++) {
+      if (pgm_read_byte(&gsm7[i]) == c) {
+        code[0] = i;
+        return 1;
+      }
+    }
+    for (uint8_t i=0; i<GSM7EXT_COUNT; i++) {
+      if (pgm_read_byte(&gsm7ext[i][1]) == c) {
+        code[0] = SIM90X_PDU_ESC;
+        code[1] = pgm_read_byte(&gsm7ext[i][0]);
+        return 2;
+      }
+    }
+  }
+  code[0] = '?';
+  return 1;
+}
+
+uint8_t SIM90XPDU::septets(uint8_t c) {
+  uint8_t code[2];
+  return toGSM7(c, code);
+}
+
+uint8_t SIM90XPDU::fromGSM7(uint8_t code, boolean escaped) {
+  if (escaped) {
+    for (uint8_t i=0; i<GSM7EXT_COUNT; i++) {
+      if (pgm_read_byte(&gsm7ext[i][0]) == code)
+        return pgm_read_byte(&gsm7ext[i][1]);
+    }
+  }
+
+  uint8_t c = pgm_read_byte(&gsm7[code & 0x7F]);
+  return c ? c : '?';
+}
+
+/********* SUBMIT ******************************************************/
+
+// How many bytes of data fit in room septets (GSM 7-bit) or octets.
+// Escaped characters are never split.
+static uint16_t fit(const uint8_t *data, uint16_t len, uint8_t dcs, uint16_t room) {
+  uint16_t n = 0;
+
+  if (dcs != SIM90X_PDU_GSM7)
+    return min(len, room);
+
+  while (n < len) {
+    uint8_t s = SIM90XPDU::septets(data[n]);
+    if (s > room) break;
+    room -= s;
+    n++;
+  }
+  return n;
+}
+
+// Payload of one message: 160 septets or 140 octets, less the 6 octet
+// concatenation header of a multipart message.
+static uint16_t room(uint8_t dcs, boolean concat) {
+  if (dcs == SIM90X_PDU_GSM7)
+    return concat ? 160 - udhSeptets(6) : 160;
+  return concat ? 134 : 140;
+}
+
+uint8_t SIM90XPDU::parts(const uint8_t *data, uint16_t len, uint8_t dcs) {
+  uint8_t n = 0;
+
+  if (fit(data, len, dcs, room(dcs, false)) == len)
+    return 1;
+
+  while (len) {
+    uint16_t k = fit(data, len, dcs, room(dcs, true));
+    data += k;
+    len -= k;
+    n++;
+  }
+  return n;
+}
+
+uint8_t SIM90XPDU::submit(uint8_t *tpdu, const char *addr,
+                          const uint8_t *data, uint16_t len, uint8_t dcs,
+                          uint8_t ref, uint8_t part) {
+  uint8_t total = parts(data, len, dcs);
+  uint16_t span = len;
+  uint8_t udhl = 0;
+  uint8_t toa = 0x81;
+  uint8_t i = 0;
+
+  if (part < 1 || part > total) return 0;
+
+  if (*addr == '+') {
+    toa = 0x91;   // international number
+    addr++;
+  }
+  uint8_t digits = strlen(addr);
+  if (digits > 20) return 0;
+
+  // skip the parts before this one
+  if (total > 1) {
+    for (uint8_t p=1; p<=part; p++) {
+      span = fit(data, len, dcs, room(dcs, true));
+      if (p == part) break;
+      data += span;
+      len -= span;
+    }
+  }
+
+  tpdu[i++] = 0x01 | (total > 1 ? 0x40 : 0);  // SMS-SUBMIT, UDH present
+  tpdu[i++] = 0x00;                           // reference set by the modem
+
+  // destination address, swapped semi-octets padded with F
+  tpdu[i++] = digits;
+  tpdu[i++] = toa;
+  for (uint8_t k=0; k<digits; k+=2) {
+    uint8_t hi = (k+1 < digits) ? addr[k+1] - '0' : 0x0F;
+    tpdu[i++] = (addr[k] - '0') | (hi << 4);
+  }
+
+  tpdu[i++] = 0x00;  // PID
+  tpdu[i++] = dcs;
+
+  uint8_t *udl = &tpdu[i++];
+  uint8_t *ud = &tpdu[i];
+
+  if (total > 1) {
+    ud[0] = 5;       // header length
+    ud[1] = 0x00;    // concatenation, 8-bit reference
+    ud[2] = 3;
+    ud[3] = ref;
+    ud[4] = total;
+    ud[5] = part;
+    udhl = 6;
+  }
+
+  if (dcs == SIM90X_PDU_GSM7) {
+    // septets start at the first septet boundary after the header
+    uint16_t bit = udhSeptets(udhl) * 7;
+
+    memset(ud + udhl, 0, 140 - udhl);
+    for (uint16_t k=0; k<span; k++) {
+      uint8_t code[2];
+      uint8_t n = toGSM7(data[k], code);
+      for (uint8_t j=0; j<n; j++) {
+        pack7(ud, bit, code[j]);
+        bit += 7;
+      }
+    }
+    *udl = bit / 7;
+    i += (bit + 7) / 8;
+  } else {
+    memcpy(ud + udhl, data, span);
+    *udl = udhl + span;
+    i += udhl + span;
+  }
+
+  return i;
+}
+
+/********* DELIVER *****************************************************/
+
+// Alphabet of a TP-DCS value (3GPP TS 23.038)
+static uint8_t alphabet(uint8_t dcs) {
+  if ((dcs & 0x80) == 0)                   // general data coding
+    return (dcs & 0x0C) == SIM90X_PDU_UCS2 ? SIM90X_PDU_UCS2 :
+           (dcs & 0x0C) ? SIM90X_PDU_8BIT : SIM90X_PDU_GSM7;
+  if ((dcs & 0xF0) == 0xF0)                // data coding/message class
+    return (dcs & 0x04) ? SIM90X_PDU_8BIT : SIM90X_PDU_GSM7;
+  if ((dcs & 0xF0) == 0xE0)                // message waiting, UCS2
+    return SIM90X_PDU_UCS2;
+  return SIM90X_PDU_GSM7;
+}
+
+// Two digits of a swapped semi-octet value
+static char *put2(char *p, uint8_t o) {
+  *p++ = '0' + (o & 0x0F) % 10;
+  *p++ = '0' + (o >> 4) % 10;
+  return p;
+}
+
+boolean SIM90XPDU::deliver(const uint8_t *pdu, uint16_t len, SIM90X_pdu_t *msg) {
+  uint16_t i;
+
+  // skip the SMSC address
+  if (len < 1) return false;
+  i = 1 + pdu[0];
+  if (i + 2 > len) return false;
+
+  uint8_t fo = pdu[i++];
+  if ((fo & 0x03) != 0) return false;  // not an SMS-DELIVER
+
+  // originating address
+  uint8_t digits = pdu[i++];
+  uint8_t octets = (digits + 1) / 2;
+  if (i + 1 + octets > len) return false;
+  uint8_t toa = pdu[i++];
+  char *p = msg->sender;
+
+  if ((toa & 0x70) == 0x50) {
+    // alphanumeric, packed in the GSM 7-bit alphabet
+    uint8_t n = digits * 4 / 7;
+    for (uint8_t k=0; k<n && k<sizeof(msg->sender)-1; k++)
+      *p++ = fromGSM7(unpack7(pdu + i, k * 7), false);
+  } else {
+    if ((toa & 0x70) == 0x10) *p++ = '+';
+    for (uint8_t k=0; k<digits && k<sizeof(msg->sender)-2; k++) {
+      uint8_t d = (k & 1) ? pdu[i + k/2] >> 4 : pdu[i + k/2] & 0x0F;
+      *p++ = d < 10 ? '0' + d : "*#abc"[(d - 10) % 5];
+    }
+  }
+  *p = 0;
+  i += octets;
+
+  // PID, DCS, timestamp and UDL
+  if (i + 10 > len) return false;
+  i++;
+  uint8_t dcs = pdu[i++];
+
+  p = msg->timestamp;
+  p = put2(p, pdu[i]);   *p++ = '/';
+  p = put2(p, pdu[i+1]); *p++ = '/';
+  p = put2(p, pdu[i+2]); *p++ = ',';
+  p = put2(p, pdu[i+3]); *p++ = ':';
+  p = put2(p, pdu[i+4]); *p++ = ':';
+  p = put2(p, pdu[i+5]);
+  // time zone in quarter hours, sign in bit 3
+  *p++ = (pdu[i+6] & 0x08) ? '-' : '+';
+  p = put2(p, pdu[i+6] & 0xF7);
+  *p = 0;
+  i += 7;
+
+  uint8_t udl = pdu[i++];
+  const uint8_t *ud = pdu + i;
+  uint16_t avail = len - i;
+  uint8_t udhl = 0;
+
+  msg->dcs = alphabet(dcs);
+  msg->ref = 0;
+  msg->total = 1;
+  msg->seq = 1;
+  msg->len = 0;
+
+  if (fo & 0x40) {
+    if (avail < 1 || ud[0] + 1u > avail) return false;
+    udhl = ud[0] + 1;
+    for (uint8_t k=1; k+1<udhl; k+=2+ud[k+1]) {
+      if (ud[k] == 0x00 && ud[k+1] == 3) {          // 8-bit reference
+        msg->ref = ud[k+2];
+        msg->total = ud[k+3];
+        msg->seq = ud[k+4];
+      } else if (ud[k] == 0x08 && ud[k+1] == 4) {   // 16-bit reference
+        msg->ref = (ud[k+2] << 8) | ud[k+3];
+        msg->total = ud[k+4];
+        msg->seq = ud[k+5];
+      }
+    }
+  }
+
+  if (msg->dcs == SIM90X_PDU_GSM7) {
+    if ((udl * 7 + 7) / 8 > avail) return false;
+    for (uint16_t s=udhSeptets(udhl); s<udl && msg->len<sizeof(msg->data); s++) {
+      uint8_t code = unpack7(ud, s * 7);
+      boolean escaped = (code == SIM90X_PDU_ESC && s+1 < udl);
+      if (escaped)
+        code = unpack7(ud, ++s * 7);
+      msg->data[msg->len++] = fromGSM7(code, escaped);
+    }
+  } else {
+    if (udl > avail || udl < udhl) return false;
+    msg->len = min((uint16_t)(udl - udhl), (uint16_t)sizeof(msg->data));
+    memcpy(msg->data, ud + udhl, msg->len);
+  }
+
+  return true;
+}
+
+/********* REASSEMBLY **************************************************/
+
+SIM90XConcat::SIM90XConcat()
+{
+  memset(slots, 0, sizeof(slots));
+  clock = 0;
+  done = 0;
+  donelen = 0;
+}
+
+const uint8_t *SIM90XConcat::data(void) {
+  return done;
+}
+
+uint16_t SIM90XConcat::length(void) {
+  return donelen;
+}
+
+boolean SIM90XConcat::add(const SIM90X_pdu_t *msg) {
+  uint8_t s, use = 0xFF;
+
+  done = 0;
+  donelen = 0;
+
+  if (msg->total <= 1) {
+    done = msg->data;
+    donelen = msg->len;
+    return true;
+  }
+  if (msg->total > SIM90X_PDU_CONCAT_PARTS || msg->seq < 1 || msg->seq > msg->total)
+    return false;
+
+  // the slot collecting this message, else a free one, else the oldest
+  for (s=0; s<SIM90X_PDU_CONCAT_SLOTS; s++) {
+    if (slots[s].total == msg->total && slots[s].ref == msg->ref &&
+        strcmp(slots[s].sender, msg->sender) == 0)
+      break;
+    if (use == 0xFF || ! slots[s].total ||
+        (slots[use].total && slots[s].age < slots[use].age))
+      use = s;
+  }
+  if (s == SIM90X_PDU_CONCAT_SLOTS) {
+    s = use;
+    strncpy(slots[s].sender, msg->sender, sizeof(slots[s].sender));
+    slots[s].ref = msg->ref;
+    slots[s].total = msg->total;
+    slots[s].have = 0;
+  }
+
+  uint8_t k = msg->seq - 1;
+  slots[s].lens[k] = min(msg->len, (uint16_t)SIM90X_PDU_PART_DATA);
+  memcpy(slots[s].data + k * SIM90X_PDU_PART_DATA, msg->data, slots[s].lens[k]);
+  slots[s].have |= 1 << k;
+  slots[s].age = ++clock;
+
+  if (slots[s].have != (uint8_t)((1 << msg->total) - 1))
+    return false;
+
+  // join the parts in place and free the slot
+  for (k=0; k<msg->total; k++) {
+    memmove(slots[s].data + donelen, slots[s].data + k * SIM90X_PDU_PART_DATA, slots[s].lens[k]);
+    donelen += slots[s].lens[k];
+  }
+  slots[s].total = 0;
+  done = slots[s].data;
+
+  return true;
+}
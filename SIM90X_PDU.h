@@ -0,0 +1,102 @@
+/***************************************************
+  PDU-mode SMS codec for SIM90X.
+
+  Builds SMS-SUBMIT TPDUs and decodes SMS-DELIVER TPDUs with the GSM 7-bit
+  default alphabet (and its extension table), 8-bit data and UCS2.
+  Payloads that don't fit one message are split into concatenated parts
+  (8-bit reference UDH), and SIM90XConcat reassembles inbound parts in
+  fixed-size slots.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_PDU_H
+#define SIM90X_PDU_H
+
+#if (ARDUINO >= 100)
+  #include "Arduino.h"
+#else
+  #include "WProgram.h"
+#endif
+
+// Data coding schemes (TP-DCS)
+#define SIM90X_PDU_GSM7  0x00   // text, Latin-1 characters in the payload
+#define SIM90X_PDU_8BIT  0x04   // binary payload
+#define SIM90X_PDU_UCS2  0x08   // UTF-16BE payload
+
+// largest SMS-SUBMIT TPDU: header with a 20 digit address + 140 octets
+#define SIM90X_PDU_MAX_TPDU   160
+// largest decoded payload of one part (160 GSM 7-bit characters), and of
+// one part of a concatenated message
+#define SIM90X_PDU_MAX_DATA   160
+#define SIM90X_PDU_PART_DATA  153
+
+// Concatenated messages reassembled at the same time, and parts per
+// message (up to 8)
+#ifndef SIM90X_PDU_CONCAT_SLOTS
+  #define SIM90X_PDU_CONCAT_SLOTS 1
+#endif
+#ifndef SIM90X_PDU_CONCAT_PARTS
+  #define SIM90X_PDU_CONCAT_PARTS 4
+#endif
+
+// One received message (part), see SIM90XPDU::deliver()
+typedef struct {
+  char sender[24];
+  char timestamp[24];  // "yy/MM/dd,hh:mm:ss+zz" as in text mode
+  uint8_t dcs;         // SIM90X_PDU_GSM7, SIM90X_PDU_8BIT or SIM90X_PDU_UCS2
+  uint16_t ref;        // concatenation reference
+  uint8_t total;       // number of parts, 1 when not concatenated
+  uint8_t seq;         // this part, 1..total
+  uint16_t len;
+  uint8_t data[SIM90X_PDU_MAX_DATA];
+} SIM90X_pdu_t;
+
+class SIM90XPDU {
+ public:
+  // Number of messages needed to send len bytes of payload with dcs.
+  static uint8_t parts(const uint8_t *data, uint16_t len, uint8_t dcs);
+
+  // Build part <part> (1..parts()) of the payload as an SMS-SUBMIT TPDU
+  // into tpdu (SIM90X_PDU_MAX_TPDU bytes). Parts of one payload share ref.
+  // Returns the TPDU length, 0 if the address doesn't fit.
+  static uint8_t submit(uint8_t *tpdu, const char *addr,
+                        const uint8_t *data, uint16_t len, uint8_t dcs,
+                        uint8_t ref, uint8_t part);
+
+  // Decode an SMS-DELIVER TPDU preceded by the SMSC address, as shown by
+  // AT+CMGR and +CMT in PDU mode.
+  static boolean deliver(const uint8_t *pdu, uint16_t len, SIM90X_pdu_t *msg);
+
+  // Latin-1 <-> GSM 7-bit default alphabet
+  static uint8_t septets(uint8_t c);
+  static uint8_t toGSM7(uint8_t c, uint8_t *code);
+  static uint8_t fromGSM7(uint8_t code, boolean escaped);
+};
+
+class SIM90XConcat {
+ public:
+  SIM90XConcat();
+
+  // Add a received part. Returns true when it completes a message, whose
+  // payload data()/length() return until the next add().
+  boolean add(const SIM90X_pdu_t *msg);
+  const uint8_t *data(void);
+  uint16_t length(void);
+
+ private:
+  struct {
+    char sender[24];
+    uint16_t ref;
+    uint8_t total;
+    uint8_t have;                 // bit per received part
+    uint16_t age;
+    uint8_t lens[SIM90X_PDU_CONCAT_PARTS];
+    uint8_t data[SIM90X_PDU_CONCAT_PARTS * SIM90X_PDU_PART_DATA];
+  } slots[SIM90X_PDU_CONCAT_SLOTS];
+  uint16_t clock;
+
+  const uint8_t *done;
+  uint16_t donelen;
+};
+
+#endif
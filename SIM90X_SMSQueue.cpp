@@ -0,0 +1,119 @@
+/***************************************************
+  Outbound SMS queue for SIM90X.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include "SIM90X_SMSQueue.h"
+
+#if SIM90X_ENABLE_SMS
+
+SIM90XSMSQueue::SIM90XSMSQueue(SIM90X &modem)
+{
+  this->modem = &modem;
+  callback = 0;
+  arenalen = 0;
+  count = 0;
+  nextid = 0;
+  waiting = false;
+  retryat = 0;
+  sent = failed = 0;
+  burstcount = 0;
+  burstms = 0;
+}
+
+void SIM90XSMSQueue::setCallback(SIM90X_SMSQueue_callback callback) {
+  this->callback = callback;
+}
+
+uint8_t SIM90XSMSQueue::pending(void) {
+  return count;
+}
+
+void SIM90XSMSQueue::getStats(uint32_t *sent, uint32_t *failed) {
+  *sent = this->sent;
+  *failed = this->failed;
+}
+
+uint16_t SIM90XSMSQueue::rate(void) {
+  if (! burstcount) return 0;
+  uint32_t r = (uint32_t)burstcount * 60000UL / max(burstms, (uint32_t)1);
+  return min(r, (uint32_t)0xFFFF);
+}
+
+uint16_t SIM90XSMSQueue::add(const char *addr, const char *text) {
+  uint16_t addrlen = strlen(addr) + 1;
+  uint16_t len = addrlen + strlen(text) + 1;
+
+  if (count == SIM90X_SMSQUEUE_MAX || arenalen + len > sizeof(arena))
+    return 0;
+
+  if (++nextid == 0) nextid = 1;
+
+  memcpy(arena + arenalen, addr, addrlen);
+  strcpy((char *)arena + arenalen + addrlen, text);
+
+  table[count].id = nextid;
+  table[count].offset = arenalen;
+  table[count].len = len;
+  table[count].tries = 0;
+  count++;
+  arenalen += len;
+
+  return nextid;
+}
+
+// Drop the head of the queue and compact the arena.
+void SIM90XSMSQueue::release(void) {
+  uint16_t len = table[0].len;
+
+  memmove(arena, arena + len, arenalen - len);
+  arenalen -= len;
+  for (uint8_t i=0; i+1<count; i++) {
+    table[i] = table[i+1];
+    table[i].offset -= len;
+  }
+  count--;
+}
+
+void SIM90XSMSQueue::loop(void) {
+  uint32_t start;
+  uint16_t n = 0;
+
+  if (! count) return;
+  if (waiting && (int32_t)(millis() - retryat) < 0) return;
+  waiting = false;
+
+  // hold the relay link open until the burst is over
+  modem->setSMSLinkHold(1);
+
+  start = millis();
+  while (count) {
+    char *addr = (char *)arena + table[0].offset;
+    char *text = addr + strlen(addr) + 1;
+    uint16_t id = table[0].id;
+    uint8_t mr;
+
+    if (modem->sendSMS(addr, text, &mr)) {
+      sent++;
+      n++;
+      release();
+      if (callback) callback(id, mr);
+    } else if (++table[0].tries >= SIM90X_SMSQUEUE_RETRIES) {
+      failed++;
+      release();
+      if (callback) callback(id, -1);
+    } else {
+      // keep the order, try the head again later
+      waiting = true;
+      retryat = millis() + SIM90X_SMSQUEUE_RETRY_MS;
+      break;
+    }
+  }
+
+  if (n) {
+    burstcount = n;
+    burstms = millis() - start;
+  }
+}
+
+#endif
@@ -0,0 +1,79 @@
+/***************************************************
+  Outbound SMS queue for SIM90X.
+
+  Messages are copied into a fixed-size arena and sent back to back from
+  loop(), with the relay link held open across the burst (AT+CMMS=1)
+  and text mode set once. Each message gets an id when queued; the
+  callback reports its message reference, or -1 once it has failed
+  SIM90X_SMSQUEUE_RETRIES times.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_SMSQUEUE_H
+#define SIM90X_SMSQUEUE_H
+
+#include "SIM90X.h"
+
+#if SIM90X_ENABLE_SMS
+
+// room for the queued numbers and texts
+#ifndef SIM90X_SMSQUEUE_ARENA_SIZE
+  #define SIM90X_SMSQUEUE_ARENA_SIZE 512
+#endif
+
+#ifndef SIM90X_SMSQUEUE_MAX
+  #define SIM90X_SMSQUEUE_MAX 8
+#endif
+
+#define SIM90X_SMSQUEUE_RETRIES   3
+#define SIM90X_SMSQUEUE_RETRY_MS  10000
+
+typedef void (*SIM90X_SMSQueue_callback)(uint16_t id, int16_t mr);
+
+class SIM90XSMSQueue {
+ public:
+  SIM90XSMSQueue(SIM90X &modem);
+
+  // Queue a message. Returns its id, 0 if the queue is full.
+  uint16_t add(const char *addr, const char *text);
+
+  // Send everything queued. Call it often from loop().
+  void loop(void);
+
+  void setCallback(SIM90X_SMSQueue_callback callback);
+  uint8_t pending(void);
+
+  // Messages sent and given up on so far, and the messages per minute
+  // reached by the last burst.
+  void getStats(uint32_t *sent, uint32_t *failed);
+  uint16_t rate(void);
+
+ private:
+  SIM90X *modem;
+  SIM90X_SMSQueue_callback callback;
+
+  uint8_t arena[SIM90X_SMSQUEUE_ARENA_SIZE];
+  uint16_t arenalen;
+  struct {
+    uint16_t id;
+    uint16_t offset;   // number, then text, both null terminated
+    uint16_t len;
+    uint8_t tries;
+  } table[SIM90X_SMSQUEUE_MAX];
+  uint8_t count;
+  uint16_t nextid;
+
+  boolean waiting;     // the head failed, retry at retryat
+  uint32_t retryat;
+
+  uint32_t sent;
+  uint32_t failed;
+  uint16_t burstcount;
+  uint32_t burstms;
+
+  void release(void);
+};
+
+#endif
+
+#endif
@@ -0,0 +1,186 @@
+/***************************************************
+  Arduino core shim for running SIM90X on Linux.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include "Arduino.h"
+
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+HostSerial Serial;
+
+/********* TIMING *********************************************************/
+
+static uint64_t monotonic_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t start_us = monotonic_us();
+
+unsigned long millis(void) {
+  return (monotonic_us() - start_us) / 1000;
+}
+
+unsigned long micros(void) {
+  return monotonic_us() - start_us;
+}
+
+void delay(unsigned long ms) {
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) != 0) ;
+}
+
+void delayMicroseconds(unsigned int us) {
+  struct timespec ts;
+
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000L;
+  while (nanosleep(&ts, &ts) != 0) ;
+}
+
+void yield(void) {
+  sched_yield();
+}
+
+/********* GPIO ***********************************************************/
+
+static void sysfs_write(const char *path, const char *value) {
+  FILE *f = fopen(path, "w");
+
+  if (f == 0) return;  // no such pin, or not allowed
+  fputs(value, f);
+  fclose(f);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  char path[48];
+
+  snprintf(path, sizeof(path), "/sys/class/gpio/gpio%u", pin);
+  if (access(path, F_OK) != 0) {
+    snprintf(path, sizeof(path), "%u", pin);
+    sysfs_write("/sys/class/gpio/export", path);
+  }
+  snprintf(path, sizeof(path), "/sys/class/gpio/gpio%u/direction", pin);
+  sysfs_write(path, mode == OUTPUT ? "out" : "in");
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+  char path[48];
+
+  snprintf(path, sizeof(path), "/sys/class/gpio/gpio%u/value", pin);
+  sysfs_write(path, val ? "1" : "0");
+}
+
+int digitalRead(uint8_t pin) {
+  char path[48];
+  int c = '0';
+
+  snprintf(path, sizeof(path), "/sys/class/gpio/gpio%u/value", pin);
+  FILE *f = fopen(path, "r");
+  if (f) {
+    c = fgetc(f);
+    fclose(f);
+  }
+  return c == '1' ? HIGH : LOW;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode) {
+  (void)interrupt; (void)isr; (void)mode;
+}
+
+void detachInterrupt(uint8_t interrupt) {
+  (void)interrupt;
+}
+
+/********* PRINT / STREAM *************************************************/
+
+size_t Print::write(const uint8_t *buf, size_t size) {
+  size_t n = 0;
+
+  while (size--)
+    n += write(*buf++);
+  return n;
+}
+
+size_t Print::printNumber(unsigned long n, int base) {
+  char buf[8 * sizeof(long) + 1];
+  char *p = buf + sizeof(buf) - 1;
+
+  if (base < 2) base = 10;
+  *p = 0;
+  do {
+    uint8_t d = n % base;
+    *--p = d < 10 ? '0' + d : 'A' + d - 10;
+    n /= base;
+  } while (n);
+  return write(p);
+}
+
+size_t Print::print(const __FlashStringHelper *s) { return write((const char *)s); }
+size_t Print::print(const char *s) { return write(s); }
+size_t Print::print(char c) { return write((uint8_t)c); }
+size_t Print::print(unsigned char n, int base) { return printNumber(n, base); }
+size_t Print::print(int n, int base) { return print((long)n, base); }
+size_t Print::print(unsigned int n, int base) { return printNumber(n, base); }
+size_t Print::print(unsigned long n, int base) { return printNumber(n, base); }
+
+size_t Print::print(long n, int base) {
+  if (base == DEC && n < 0)
+    return write((uint8_t)'-') + printNumber(0UL - (unsigned long)n, DEC);
+  return printNumber(n, base);
+}
+
+size_t Print::print(double n, int digits) {
+  char buf[32];
+
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return write(buf);
+}
+
+size_t Print::println(void) { return write("\r\n"); }
+size_t Print::println(const __FlashStringHelper *s) { return print(s) + println(); }
+size_t Print::println(const char *s) { return print(s) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(unsigned char n, int base) { return print(n, base) + println(); }
+size_t Print::println(int n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned int n, int base) { return print(n, base) + println(); }
+size_t Print::println(long n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned long n, int base) { return print(n, base) + println(); }
+size_t Print::println(double n, int digits) { return print(n, digits) + println(); }
+
+size_t Stream::readBytes(char *buf, size_t len) {
+  size_t n = 0;
+  unsigned long start = millis();
+
+  while (n < len) {
+    int c = read();
+    if (c >= 0) {
+      buf[n++] = c;
+      continue;
+    }
+    unsigned long waited = millis() - start;
+    if (waited >= timeout) break;
+    waitReadable(timeout - waited);
+  }
+  return n;
+}
+
+size_t HostSerial::write(uint8_t c) {
+  return fputc(c, stdout) == EOF ? 0 : 1;
+}
+
+size_t HostSerial::write(const uint8_t *buf, size_t size) {
+  return fwrite(buf, 1, size, stdout);
+}
+
+void HostSerial::flush(void) {
+  fflush(stdout);
+}
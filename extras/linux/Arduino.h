@@ -0,0 +1,138 @@
+/***************************************************
+  Arduino core shim for running SIM90X on Linux.
+
+  Just enough of the Arduino API for the library: Print/Stream, timing
+  on the monotonic clock, GPIO through sysfs and PROGMEM as plain memory.
+  Build with -DARDUINO=100 and this directory first on the include path.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_LINUX_ARDUINO_H
+#define SIM90X_LINUX_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <avr/pgmspace.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH     1
+#define LOW      0
+#define INPUT    0
+#define OUTPUT   1
+#define CHANGE   1
+#define FALLING  2
+#define RISING   3
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(PSTR(s)))
+
+// templates rather than the AVR macros, so the C++ headers still build.
+// Both sides are compared as the result type, as the macros would.
+template<class A, class B> inline auto min(A a, B b) -> decltype(true ? A() : B()) {
+  typedef decltype(true ? A() : B()) T;
+  return (T)a < (T)b ? a : b;
+}
+template<class A, class B> inline auto max(A a, B b) -> decltype(true ? A() : B()) {
+  typedef decltype(true ? A() : B()) T;
+  return (T)a > (T)b ? a : b;
+}
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield(void);
+
+// Pins are sysfs GPIO numbers (/sys/class/gpio/gpio<pin>). Interrupts
+// aren't available, incoming calls are seen through their URCs.
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t interrupt, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t interrupt);
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buf, size_t size);
+  size_t write(const char *s) { return s ? write((const uint8_t *)s, strlen(s)) : 0; }
+  size_t write(const char *buf, size_t size) { return write((const uint8_t *)buf, size); }
+  virtual void flush(void) {}
+
+  size_t print(const __FlashStringHelper *s);
+  size_t print(const char *s);
+  size_t print(char c);
+  size_t print(unsigned char n, int base = DEC);
+  size_t print(int n, int base = DEC);
+  size_t print(unsigned int n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(double n, int digits = 2);
+
+  size_t println(void);
+  size_t println(const __FlashStringHelper *s);
+  size_t println(const char *s);
+  size_t println(char c);
+  size_t println(unsigned char n, int base = DEC);
+  size_t println(int n, int base = DEC);
+  size_t println(unsigned int n, int base = DEC);
+  size_t println(long n, int base = DEC);
+  size_t println(unsigned long n, int base = DEC);
+  size_t println(double n, int digits = 2);
+
+ private:
+  size_t printNumber(unsigned long n, int base);
+};
+
+class Stream : public Print {
+ public:
+  virtual int available(void) = 0;
+  virtual int read(void) = 0;
+  virtual int peek(void) = 0;
+
+  // Block up to ms until there is input. Ports that can't wait for
+  // input just sleep 1 ms.
+  virtual void waitReadable(unsigned long ms) { (void)ms; delay(1); }
+
+  void setTimeout(unsigned long ms) { timeout = ms; }
+  size_t readBytes(char *buf, size_t len);
+  size_t readBytes(uint8_t *buf, size_t len) { return readBytes((char *)buf, len); }
+
+ protected:
+  unsigned long timeout = 1000;
+};
+
+// stdout, for the library's debug output and sketches
+class HostSerial : public Stream {
+ public:
+  void begin(unsigned long baud) { (void)baud; }
+  int available(void) { return 0; }
+  int read(void) { return -1; }
+  int peek(void) { return -1; }
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buf, size_t size);
+  void flush(void);
+  using Print::write;
+};
+
+extern HostSerial Serial;
+
+// the library's read loops block in the kernel, see PosixSerial
+#define SIM90X_WAIT_INPUT(port, ms) (port)->waitReadable(ms)
+
+#include "IPAddress.h"
+
+#endif
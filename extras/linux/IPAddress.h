@@ -0,0 +1,32 @@
+/***************************************************
+  IPv4 address for the Linux Arduino shim.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_LINUX_IPADDRESS_H
+#define SIM90X_LINUX_IPADDRESS_H
+
+#include <stdint.h>
+
+class IPAddress {
+ public:
+  IPAddress() { addr.dword = 0; }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    addr.bytes[0] = a; addr.bytes[1] = b; addr.bytes[2] = c; addr.bytes[3] = d;
+  }
+  IPAddress(uint32_t a) { addr.dword = a; }
+
+  operator uint32_t() const { return addr.dword; }
+  uint8_t operator[](int i) const { return addr.bytes[i]; }
+  uint8_t &operator[](int i) { return addr.bytes[i]; }
+
+ private:
+  union {
+    uint8_t bytes[4];
+    uint32_t dword;
+  } addr;
+
+  friend class Client;
+};
+
+#endif
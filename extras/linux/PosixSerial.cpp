@@ -0,0 +1,149 @@
+/***************************************************
+  termios serial port for running SIM90X on Linux.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include "PosixSerial.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+static speed_t baudrate(unsigned long baud) {
+  switch (baud) {
+    case 1200:   return B1200;
+    case 2400:   return B2400;
+    case 4800:   return B4800;
+    case 9600:   return B9600;
+    case 19200:  return B19200;
+    case 38400:  return B38400;
+    case 57600:  return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+  }
+  return 0;
+}
+
+PosixSerial::PosixSerial()
+{
+  tty = -1;
+  epfd = -1;
+  rxhead = rxlen = 0;
+}
+
+PosixSerial::~PosixSerial() {
+  end();
+}
+
+boolean PosixSerial::begin(const char *path, unsigned long baud) {
+  struct termios tio;
+  struct epoll_event ev;
+  speed_t speed = baudrate(baud);
+
+  end();
+  if (! speed) {
+    errno = EINVAL;
+    return false;
+  }
+
+  tty = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (tty < 0) return false;
+
+  if (tcgetattr(tty, &tio) != 0) {
+    end();
+    return false;
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  if (tcsetattr(tty, TCSANOW, &tio) != 0) {
+    end();
+    return false;
+  }
+  tcflush(tty, TCIOFLUSH);
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  ev.events = EPOLLIN;
+  ev.data.fd = tty;
+  if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, tty, &ev) != 0) {
+    end();
+    return false;
+  }
+  return true;
+}
+
+void PosixSerial::end(void) {
+  if (epfd >= 0) close(epfd);
+  if (tty >= 0) close(tty);
+  epfd = tty = -1;
+  rxhead = rxlen = 0;
+}
+
+int PosixSerial::fd(void) {
+  return tty;
+}
+
+// Move what the kernel holds into rxbuf, without blocking.
+void PosixSerial::fill(void) {
+  if (tty < 0) return;
+  if (rxhead == rxlen)
+    rxhead = rxlen = 0;
+
+  ssize_t n = ::read(tty, rxbuf + rxlen, sizeof(rxbuf) - rxlen);
+  if (n > 0) rxlen += n;
+}
+
+int PosixSerial::available(void) {
+  if (rxhead == rxlen) fill();
+  return rxlen - rxhead;
+}
+
+int PosixSerial::read(void) {
+  if (! available()) return -1;
+  return rxbuf[rxhead++];
+}
+
+int PosixSerial::peek(void) {
+  if (! available()) return -1;
+  return rxbuf[rxhead];
+}
+
+size_t PosixSerial::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t PosixSerial::write(const uint8_t *buf, size_t size) {
+  size_t done = 0;
+
+  while (tty >= 0 && done < size) {
+    ssize_t n = ::write(tty, buf + done, size - done);
+    if (n > 0) {
+      done += n;
+    } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      // output queue full, wait for room
+      struct pollfd p = { tty, POLLOUT, 0 };
+      poll(&p, 1, 1000);
+    } else {
+      break;
+    }
+  }
+  return done;
+}
+
+void PosixSerial::flush(void) {
+  if (tty >= 0) tcdrain(tty);
+}
+
+void PosixSerial::waitReadable(unsigned long ms) {
+  struct epoll_event ev;
+
+  if (rxhead != rxlen || epfd < 0) return;
+  epoll_wait(epfd, &ev, 1, ms > 0x7FFFFFFFUL ? -1 : (int)ms);
+}
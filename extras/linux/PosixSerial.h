@@ -0,0 +1,53 @@
+/***************************************************
+  termios serial port for running SIM90X on Linux.
+
+  A Stream over a tty (or a pty, to talk to a simulated modem). The port
+  is non-blocking; waitReadable() sleeps in epoll_wait() until input
+  arrives, so the library's read loops use no CPU while the modem is
+  quiet.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_POSIXSERIAL_H
+#define SIM90X_POSIXSERIAL_H
+
+#include "Arduino.h"
+
+#ifndef POSIXSERIAL_RXBUFFER_SIZE
+  #define POSIXSERIAL_RXBUFFER_SIZE 512
+#endif
+
+class PosixSerial : public Stream {
+ public:
+  PosixSerial();
+  ~PosixSerial();
+
+  // Open path raw at baud, 8N1 without flow control. Returns false with
+  // errno set.
+  boolean begin(const char *path, unsigned long baud = 115200);
+  void end(void);
+
+  int available(void);
+  int read(void);
+  int peek(void);
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buf, size_t size);
+  void flush(void);
+  using Print::write;
+
+  void waitReadable(unsigned long ms);
+
+  // the tty, e.g. to add it to an event loop of your own
+  int fd(void);
+
+ private:
+  int tty;
+  int epfd;
+  uint8_t rxbuf[POSIXSERIAL_RXBUFFER_SIZE];
+  uint16_t rxhead;
+  uint16_t rxlen;
+
+  void fill(void);
+};
+
+#endif
@@ -0,0 +1,225 @@
+/***************************************************
+  Thread-safe access to one SIM90X on Linux.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include "SIM90XChannel.h"
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+static void notify(int fd) {
+  uint64_t one = 1;
+
+  if (::write(fd, &one, sizeof(one)) < 0) {
+    // the counter is already set, the reader wakes anyway
+  }
+}
+
+static void drain(int fd) {
+  uint64_t n;
+
+  if (::read(fd, &n, sizeof(n)) < 0) {
+    // nothing to clear
+  }
+}
+
+/********* URC QUEUE ******************************************************/
+
+SIM90XURCQueue::SIM90XURCQueue()
+{
+  head = 0;
+  tail = 0;
+  drops = 0;
+  efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+SIM90XURCQueue::~SIM90XURCQueue() {
+  if (efd >= 0) close(efd);
+}
+
+int SIM90XURCQueue::fd(void) {
+  return efd;
+}
+
+uint32_t SIM90XURCQueue::dropped(void) {
+  return drops.load(std::memory_order_relaxed);
+}
+
+void SIM90XURCQueue::push(const char *line) {
+  uint32_t t = tail.load(std::memory_order_relaxed);
+
+  if (t - head.load(std::memory_order_acquire) == SIM90X_URCQUEUE_SIZE) {
+    drops.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  strncpy(lines[t % SIM90X_URCQUEUE_SIZE], line, SIM90X_REPLYBUFFER_SIZE-1);
+  lines[t % SIM90X_URCQUEUE_SIZE][SIM90X_REPLYBUFFER_SIZE-1] = 0;
+  tail.store(t+1, std::memory_order_release);
+  notify(efd);
+}
+
+boolean SIM90XURCQueue::pop(char *line, size_t size, int ms) {
+  unsigned long start = millis();
+
+  while (true) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h != tail.load(std::memory_order_acquire)) {
+      strncpy(line, lines[h % SIM90X_URCQUEUE_SIZE], size-1);
+      line[size-1] = 0;
+      head.store(h+1, std::memory_order_release);
+      return true;
+    }
+
+    int left = ms;
+    if (ms > 0) {
+      unsigned long waited = millis() - start;
+      if (waited >= (unsigned long)ms) return false;
+      left = ms - waited;
+    } else if (ms == 0) {
+      return false;
+    }
+
+    // push() signals after publishing the line, so nothing is missed
+    // between the check above and the wait
+    struct pollfd p = { efd, POLLIN, 0 };
+    if (poll(&p, 1, left) > 0) drain(efd);
+  }
+}
+
+/********* CHANNEL ********************************************************/
+
+// URCs of the modem. Anything else may be a reply that comes after the OK
+// of its command, so it is left to the command.
+static const char * const urcprefixes[] = {
+  "RING", "+CLIP:", "+CMTI:", "+CDS:", "+CUSD:", "*PSUTTZ:", "+CTZV:",
+  "DST:", "+PDP: DEACT", "UNDER-VOLTAGE", "OVER-VOLTAGE",
+  "NORMAL POWER DOWN", "Call Ready", "SMS Ready", 0
+};
+
+static boolean prefixed(const char *line, const char *prefix) {
+  return strncmp(line, prefix, strlen(prefix)) == 0;
+}
+
+SIM90XChannel::SIM90XChannel(SIM90X &modem, PosixSerial &port)
+{
+  this->modem = &modem;
+  this->port = &port;
+  running = false;
+  wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  nqueues = 0;
+  nprefixes = 0;
+
+  tail = new Command;
+  tail->next = 0;
+  head = tail;
+}
+
+SIM90XChannel::~SIM90XChannel() {
+  stop();
+
+  // commands that never ran break their futures
+  while (tail) {
+    Command *next = tail->next.load();
+    delete tail;
+    tail = next;
+  }
+  if (wakefd >= 0) close(wakefd);
+}
+
+boolean SIM90XChannel::subscribe(SIM90XURCQueue &queue) {
+  if (running || nqueues == SIM90X_CHANNEL_SUBSCRIBERS) return false;
+
+  queues[nqueues++] = &queue;
+  return true;
+}
+
+boolean SIM90XChannel::claim(const char *prefix) {
+  if (running || nprefixes == SIM90X_CHANNEL_PREFIXES) return false;
+
+  prefixes[nprefixes++] = prefix;
+  return true;
+}
+
+void SIM90XChannel::start(void) {
+  if (running) return;
+
+  running = true;
+  modem->setURCCallback(onURC, this);
+  owner = std::thread(&SIM90XChannel::run, this);
+}
+
+void SIM90XChannel::stop(void) {
+  if (! running) return;
+
+  running = false;
+  notify(wakefd);
+  owner.join();
+  modem->setURCCallback(0);
+}
+
+void SIM90XChannel::post(std::function<void(SIM90X &)> fn) {
+  Command *c = new Command;
+
+  c->fn = std::move(fn);
+  c->next.store(0, std::memory_order_relaxed);
+  Command *prev = head.exchange(c, std::memory_order_acq_rel);
+  prev->next.store(c, std::memory_order_release);
+  notify(wakefd);
+}
+
+// The next command, 0 if none is linked in yet. It becomes the new stub,
+// so its function is moved out of it by the caller.
+SIM90XChannel::Command *SIM90XChannel::pop(void) {
+  Command *next = tail->next.load(std::memory_order_acquire);
+
+  if (next == 0) return 0;
+  delete tail;
+  tail = next;
+  return next;
+}
+
+void SIM90XChannel::run(void) {
+  struct epoll_event ev;
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+
+  ev.events = EPOLLIN;
+  ev.data.fd = port->fd();
+  epoll_ctl(ep, EPOLL_CTL_ADD, port->fd(), &ev);
+  ev.data.fd = wakefd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, wakefd, &ev);
+
+  while (running) {
+    Command *c;
+    while ((c = pop())) {
+      std::function<void(SIM90X &)> fn = std::move(c->fn);
+      fn(*modem);
+    }
+    modem->poll();
+
+    // post() signals after linking its command, so nothing is missed
+    // between the pop above and the wait
+    if (epoll_wait(ep, &ev, 1, 1000) > 0 && ev.data.fd == wakefd)
+      drain(wakefd);
+  }
+  close(ep);
+}
+
+// Called by the modem on the owner thread.
+boolean SIM90XChannel::onURC(const char *line, void *ctx) {
+  SIM90XChannel *channel = (SIM90XChannel *)ctx;
+  boolean urc = false;
+
+  if (! channel->nqueues) return false;
+  for (uint8_t i=0; ! urc && urcprefixes[i]; i++)
+    urc = prefixed(line, urcprefixes[i]);
+  for (uint8_t i=0; ! urc && i<channel->nprefixes; i++)
+    urc = prefixed(line, channel->prefixes[i]);
+  if (! urc) return false;
+
+  for (uint8_t i=0; i<channel->nqueues; i++)
+    channel->queues[i]->push(line);
+  return true;
+}
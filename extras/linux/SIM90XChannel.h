@@ -0,0 +1,122 @@
+/***************************************************
+  Thread-safe access to one SIM90X on Linux.
+
+  A single owner thread talks to the modem. Other threads hand it
+  commands through a lock-free MPSC queue and get the results back as
+  futures or completion callbacks, so commands never interleave on the
+  port or in the shared reply buffer. URCs the library doesn't handle
+  itself are copied into SIM90XURCQueue rings (lock-free, one per
+  consumer) that any thread can wait on.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_CHANNEL_H
+#define SIM90X_CHANNEL_H
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
+
+#include "SIM90X.h"
+#include "PosixSerial.h"
+
+#ifndef SIM90X_URCQUEUE_SIZE
+  #define SIM90X_URCQUEUE_SIZE 32
+#endif
+#define SIM90X_CHANNEL_SUBSCRIBERS 4
+#define SIM90X_CHANNEL_PREFIXES    8
+
+// Single producer (the channel's owner thread), single consumer ring of
+// unsolicited lines. A full ring drops new lines and counts them.
+class SIM90XURCQueue {
+ public:
+  SIM90XURCQueue();
+  ~SIM90XURCQueue();
+
+  // Take the oldest line, waiting up to ms for one (-1 waits forever).
+  // Call it from one thread only.
+  boolean pop(char *line, size_t size, int ms = 0);
+
+  uint32_t dropped(void);
+
+  // readable when lines may be waiting, e.g. for an event loop of your own
+  int fd(void);
+
+ private:
+  friend class SIM90XChannel;
+
+  char lines[SIM90X_URCQUEUE_SIZE][SIM90X_REPLYBUFFER_SIZE];
+  std::atomic<uint32_t> head;   // next line to pop
+  std::atomic<uint32_t> tail;   // next line to push
+  std::atomic<uint32_t> drops;
+  int efd;
+
+  void push(const char *line);
+};
+
+class SIM90XChannel {
+ public:
+  // The modem must be begun on port already.
+  SIM90XChannel(SIM90X &modem, PosixSerial &port);
+  ~SIM90XChannel();
+
+  // Deliver unsolicited lines to queue too. Call it before start().
+  boolean subscribe(SIM90XURCQueue &queue);
+
+  // Deliver lines starting with prefix too, on top of the URCs of the
+  // modem that the library doesn't handle itself. Call it before start().
+  boolean claim(const char *prefix);
+
+  void start(void);
+  void stop(void);
+
+  // Run fn(modem) on the owner thread, in the order submitted.
+  void post(std::function<void(SIM90X &)> fn);
+
+  // Run fn(modem) on the owner thread and return a future of its result.
+  template <class F>
+  auto submit(F fn) -> std::future<decltype(fn(std::declval<SIM90X &>()))> {
+    typedef decltype(fn(std::declval<SIM90X &>())) R;
+    std::shared_ptr<std::packaged_task<R(SIM90X &)> > task =
+      std::make_shared<std::packaged_task<R(SIM90X &)> >(fn);
+    std::future<R> result = task->get_future();
+    post([task](SIM90X &modem) { (*task)(modem); });
+    return result;
+  }
+
+  // Run fn(modem) on the owner thread, then done(result) right after it.
+  template <class F, class D>
+  void submit(F fn, D done) {
+    post([fn, done](SIM90X &modem) { done(fn(modem)); });
+  }
+
+ private:
+  struct Command {
+    std::atomic<Command *> next;
+    std::function<void(SIM90X &)> fn;
+  };
+
+  SIM90X *modem;
+  PosixSerial *port;
+  std::thread owner;
+  std::atomic<bool> running;
+  int wakefd;
+
+  // MPSC queue: producers swap themselves in at head, the owner pops at
+  // tail. tail is a stub whose command already ran.
+  std::atomic<Command *> head;
+  Command *tail;
+
+  SIM90XURCQueue *queues[SIM90X_CHANNEL_SUBSCRIBERS];
+  uint8_t nqueues;
+  const char *prefixes[SIM90X_CHANNEL_PREFIXES];
+  uint8_t nprefixes;
+
+  Command *pop(void);
+  void run(void);
+  static boolean onURC(const char *line, void *ctx);
+};
+
+#endif
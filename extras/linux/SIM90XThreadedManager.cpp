@@ -0,0 +1,100 @@
+/***************************************************
+  SIM90XManager with a thread per modem, for Linux.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include "SIM90XThreadedManager.h"
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+SIM90XThreadedManager::SIM90XThreadedManager()
+{
+  running = false;
+  for (uint8_t i=0; i<SIM90X_MANAGER_MODEMS; i++) {
+    ports[i] = 0;
+    wakefd[i] = -1;
+  }
+}
+
+SIM90XThreadedManager::~SIM90XThreadedManager() {
+  stop();
+  for (uint8_t i=0; i<SIM90X_MANAGER_MODEMS; i++)
+    if (wakefd[i] >= 0) close(wakefd[i]);
+}
+
+void SIM90XThreadedManager::lock(void) {
+  mutex.lock();
+}
+
+void SIM90XThreadedManager::unlock(void) {
+  mutex.unlock();
+}
+
+void SIM90XThreadedManager::wake(uint8_t i) {
+  uint64_t one = 1;
+
+  if (wakefd[i] >= 0 && ::write(wakefd[i], &one, sizeof(one)) < 0) {
+    // the counter is already set, the thread wakes anyway
+  }
+}
+
+int8_t SIM90XThreadedManager::add(SIM90X &modem, PosixSerial &port) {
+  if (running) return -1;
+
+  int8_t i = SIM90XManager::add(modem);
+  if (i < 0) return i;
+
+  ports[i] = &port;
+  wakefd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return i;
+}
+
+int8_t SIM90XThreadedManager::add(SIM90X &modem) {
+  (void)modem;
+  return -1;
+}
+
+void SIM90XThreadedManager::start(void) {
+  if (running) return;
+
+  running = true;
+  for (uint8_t i=0; i<modems(); i++)
+    threads[i] = std::thread(&SIM90XThreadedManager::run, this, i);
+}
+
+void SIM90XThreadedManager::stop(void) {
+  if (! running) return;
+
+  running = false;
+  for (uint8_t i=0; i<modems(); i++) {
+    wake(i);
+    threads[i].join();
+  }
+}
+
+// Serve modem i until stop(): run its jobs, then sleep until the modem
+// says something, a job is queued for it or its health is due.
+void SIM90XThreadedManager::run(uint8_t i) {
+  struct epoll_event ev;
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+
+  ev.events = EPOLLIN;
+  ev.data.fd = ports[i]->fd();
+  epoll_ctl(ep, EPOLL_CTL_ADD, ports[i]->fd(), &ev);
+  ev.data.fd = wakefd[i];
+  epoll_ctl(ep, EPOLL_CTL_ADD, wakefd[i], &ev);
+
+  while (running) {
+    while (running && service(i)) ;
+
+    if (epoll_wait(ep, &ev, 1, 1000) > 0 && ev.data.fd == wakefd[i]) {
+      uint64_t n;
+      if (::read(wakefd[i], &n, sizeof(n)) < 0) {
+        // already cleared
+      }
+    }
+  }
+  close(ep);
+}
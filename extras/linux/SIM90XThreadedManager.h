@@ -0,0 +1,48 @@
+/***************************************************
+  SIM90XManager with a thread per modem, for Linux.
+
+  Every modem is served by its own thread, which sleeps in epoll_wait()
+  on the modem's port and on an eventfd that submit() signals, so the
+  modems run their jobs in parallel and idle threads use no CPU.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_THREADEDMANAGER_H
+#define SIM90X_THREADEDMANAGER_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "SIM90X_Manager.h"
+#include "PosixSerial.h"
+
+class SIM90XThreadedManager : public SIM90XManager {
+ public:
+  SIM90XThreadedManager();
+  ~SIM90XThreadedManager();
+
+  // Add a modem and the port it was begun on. Add them all before start().
+  int8_t add(SIM90X &modem, PosixSerial &port);
+  // Its thread needs the port: always fails, even through a SIM90XManager&.
+  int8_t add(SIM90X &modem);
+
+  void start(void);
+  void stop(void);
+
+ protected:
+  void lock(void);
+  void unlock(void);
+  void wake(uint8_t i);
+
+ private:
+  std::mutex mutex;
+  std::atomic<bool> running;
+  std::thread threads[SIM90X_MANAGER_MODEMS];
+  PosixSerial *ports[SIM90X_MANAGER_MODEMS];
+  int wakefd[SIM90X_MANAGER_MODEMS];
+
+  void run(uint8_t i);
+};
+
+#endif
@@ -0,0 +1,5 @@
+/***************************************************
+  SIM90X.h includes SoftwareSerial.h; there is none on Linux.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
@@ -0,0 +1,36 @@
+/***************************************************
+  PROGMEM for Linux: flash strings are ordinary strings.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#ifndef SIM90X_LINUX_PGMSPACE_H
+#define SIM90X_LINUX_PGMSPACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#define PROGMEM
+#define PGM_P  const char *
+#define PSTR(s) (s)
+
+#define pgm_read_byte(p)   (*(const uint8_t *)(p))
+#define pgm_read_word(p)   (*(const uint16_t *)(p))
+#define pgm_read_dword(p)  (*(const uint32_t *)(p))
+
+#define memcpy_P       memcpy
+#define strcmp_P       strcmp
+#define strncmp_P      strncmp
+#define strcasecmp_P   strcasecmp
+#define strncasecmp_P  strncasecmp
+#define strcpy_P       strcpy
+#define strncpy_P      strncpy
+#define strcat_P       strcat
+#define strlen_P       strlen
+#define strchr_P       strchr
+#define strstr_P       strstr
+#define sprintf_P      sprintf
+#define snprintf_P     snprintf
+
+#endif
@@ -0,0 +1,52 @@
+/***************************************************
+  Drive a SIM800 from Linux: report the modem and print incoming SMS.
+
+    sim90x_host /dev/ttyUSB0 [baud]
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include <errno.h>
+
+#include "SIM90X.h"
+#include "PosixSerial.h"
+
+static PosixSerial port;
+static SIM90X modem;
+
+#if SIM90X_ENABLE_SMS
+static void onSMS(SIM90X_sms_t *sms) {
+  printf("SMS from %s at %s: %s\n", sms->sender, sms->timestamp, sms->text);
+}
+#endif
+
+int main(int argc, char **argv) {
+  char imei[16];
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <tty> [baud]\n", argv[0]);
+    return 2;
+  }
+  if (! port.begin(argv[1], argc > 2 ? strtoul(argv[2], 0, 10) : 115200)) {
+    fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  if (! modem.begin(port)) {
+    fprintf(stderr, "no modem on %s\n", argv[1]);
+    return 1;
+  }
+
+  if (modem.getIMEI(imei))
+    printf("IMEI %s\n", imei);
+  printf("RSSI %u\n", modem.getRSSI());
+
+#if SIM90X_ENABLE_SMS
+  modem.setSMSCallback(onSMS);
+#endif
+
+  // sleep in the kernel until the modem has something to say
+  while (true) {
+    port.waitReadable(1000);
+    modem.poll();
+    fflush(stdout);
+  }
+}
@@ -0,0 +1,92 @@
+/***************************************************
+  SIM90XChannel against a scripted modem on a pty pair.
+
+  Runs TCPconnect and HTTP_action, whose answers come after their OK,
+  through the channel while a URC queue is subscribed, and checks that
+  the answers reach the commands and the URCs reach the queue.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include <pty.h>
+#include <unistd.h>
+
+#include "SIM90XChannel.h"
+
+static int master;
+
+static void say(const char *s) {
+  if (write(master, s, strlen(s)) < 0) perror("write");
+}
+
+// Answer every command line with OK (SHUT OK for AT+CIPSHUT), and the slow
+// ones with their late answer after it. A URC goes out before each late answer.
+static void modem(void) {
+  char line[256];
+  size_t n = 0;
+  char c;
+
+  while (read(master, &c, 1) == 1) {
+    if (c != '\r') {
+      if (c != '\n' && n < sizeof(line)-1) line[n++] = c;
+      continue;
+    }
+    line[n] = 0;
+    n = 0;
+    if (! line[0]) continue;
+
+    if (strcmp(line, "AT+CIPSHUT") == 0) {
+      say("\r\nSHUT OK\r\n");
+      continue;
+    }
+    say("\r\nOK\r\n");
+    if (strncmp(line, "AT+CIPSTART=", 12) == 0) {
+      usleep(50000);
+      say("\r\n+CUSD: 0,\"tcp\",15\r\n");
+      say("\r\nCONNECT OK\r\n");
+    } else if (strncmp(line, "AT+HTTPACTION=", 14) == 0) {
+      usleep(50000);
+      say("\r\n+CUSD: 0,\"http\",15\r\n");
+      say("\r\n+HTTPACTION: 0,200,1234\r\n");
+    }
+  }
+}
+
+#define CHECK(x) do { if (! (x)) { fprintf(stderr, "FAIL %s:%d %s\n", __FILE__, __LINE__, #x); return 1; } } while (0)
+
+int main(void) {
+  static PosixSerial port;
+  static SIM90X gsm;
+  char name[64];
+  int slave;
+
+  CHECK(openpty(&master, &slave, name, 0, 0) == 0);
+  std::thread(modem).detach();
+  CHECK(port.begin(name));
+  CHECK(gsm.begin(port));
+
+  SIM90XChannel channel(gsm, port);
+  SIM90XURCQueue urcs;
+  channel.subscribe(urcs);
+  channel.start();
+
+  std::future<boolean> connected = channel.submit([](SIM90X &m) {
+    return m.TCPconnect((char *)"example.com", 80);
+  });
+  CHECK(connected.get());
+
+  std::future<uint16_t> status = channel.submit([](SIM90X &m) -> uint16_t {
+    uint16_t status, len;
+    if (! m.HTTP_action(0, &status, &len, 1000)) return 0;
+    return len == 1234 ? status : 1;
+  });
+  CHECK(status.get() == 200);
+
+  char line[SIM90X_REPLYBUFFER_SIZE];
+  CHECK(urcs.pop(line, sizeof(line), 1000) && strcmp(line, "+CUSD: 0,\"tcp\",15") == 0);
+  CHECK(urcs.pop(line, sizeof(line), 1000) && strcmp(line, "+CUSD: 0,\"http\",15") == 0);
+  CHECK(! urcs.pop(line, sizeof(line)));
+
+  channel.stop();
+  puts("channel ok");
+  return 0;
+}
@@ -0,0 +1,191 @@
+/***************************************************
+  SIM90XMQTT against a broker stand-in on a pty pair.
+
+  The client runs over a host-side Client on the pty slave, the broker
+  answers on the master. Checks CONNECT/CONNACK, the release of a QoS 1
+  PUBLISH by its PUBACK, the DUP retransmit of an unacknowledged one
+  after SIM90X_MQTT_RETRY_MS, and the PINGREQ spacing and dead link
+  timeout of the keepalive.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include <pty.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PosixSerial.h"
+#include "SIM90X_MQTT.h"
+
+#define KEEPALIVE_S 1
+
+// A Client over a PosixSerial, standing in for SIM90XClient
+class PtyClient : public Client {
+ public:
+  PtyClient(PosixSerial &port) : port(port), open(false) {}
+
+  int connect(IPAddress ip, uint16_t p) { (void)ip; (void)p; return open = true; }
+  int connect(const char *host, uint16_t p) { (void)host; (void)p; return open = true; }
+  size_t write(uint8_t c) { return open ? port.write(c) : 0; }
+  size_t write(const uint8_t *buf, size_t size) { return open ? port.write(buf, size) : 0; }
+  int available(void) { return open ? port.available() : 0; }
+  int read(void) { return open ? port.read() : -1; }
+  int read(uint8_t *buf, size_t size) { return readBytes(buf, size); }
+  int peek(void) { return open ? port.peek() : -1; }
+  void flush(void) { port.flush(); }
+  void stop(void) { open = false; }
+  uint8_t connected(void) { return open; }
+  operator bool() { return open; }
+
+ private:
+  PosixSerial &port;
+  boolean open;
+};
+
+struct packet {
+  uint8_t header;
+  uint16_t id;
+  unsigned long at;
+};
+
+static int master;
+static std::mutex lock;
+static std::vector<packet> seen;
+static uint16_t keepalive;
+static std::atomic<bool> answerpings(true);
+
+static void say(const uint8_t *p, size_t len) {
+  if (write(master, p, len) < 0) perror("write");
+}
+
+static bool readn(uint8_t *p, size_t len) {
+  while (len) {
+    ssize_t n = read(master, p, len);
+    if (n <= 0) return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Log every packet. PUBACK a QoS 1 PUBLISH of "a" at once, one of "b"
+// only when it comes back with DUP set.
+static void broker(void) {
+  uint8_t header, digit, body[256];
+
+  while (readn(&header, 1)) {
+    uint32_t len = 0, shift = 0;
+    do {
+      if (! readn(&digit, 1)) return;
+      len |= (uint32_t)(digit & 0x7F) << shift;
+      shift += 7;
+    } while (digit & 0x80);
+    if (len > sizeof(body) || ! readn(body, len)) return;
+
+    packet p = { header, 0, millis() };
+    switch (header & 0xF0) {
+      case SIM90X_MQTT_CONNECT: {
+        keepalive = (body[8] << 8) | body[9];
+        const uint8_t connack[] = { SIM90X_MQTT_CONNACK, 2, 0, 0 };
+        say(connack, 4);
+        break;
+      }
+      case SIM90X_MQTT_PUBLISH: {
+        uint16_t topiclen = (body[0] << 8) | body[1];
+        p.id = (body[2 + topiclen] << 8) | body[3 + topiclen];
+        bool dup = header & 0x08;
+        if (body[4 + topiclen] == 'a' || dup) {
+          const uint8_t puback[] = { SIM90X_MQTT_PUBACK, 2, (uint8_t)(p.id >> 8), (uint8_t)(p.id & 0xFF) };
+          say(puback, 4);
+        }
+        break;
+      }
+      case SIM90X_MQTT_PINGREQ: {
+        const uint8_t pingresp[] = { SIM90X_MQTT_PINGRESP, 0 };
+        if (answerpings) say(pingresp, 2);
+        break;
+      }
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    seen.push_back(p);
+  }
+}
+
+static std::vector<packet> packets(uint8_t type) {
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<packet> found;
+  for (size_t i=0; i<seen.size(); i++)
+    if ((seen[i].header & 0xF0) == type) found.push_back(seen[i]);
+  return found;
+}
+
+// loop() until done() or ms have passed
+template <typename F> static void run(SIM90XMQTT &mqtt, unsigned long ms, F done) {
+  unsigned long start = millis();
+  while (! done() && millis() - start < ms) {
+    mqtt.loop();
+    delay(1);
+  }
+}
+
+#define CHECK(x) do { if (! (x)) { fprintf(stderr, "FAIL %s:%d %s\n", __FILE__, __LINE__, #x); return 1; } } while (0)
+
+int main(void) {
+  static PosixSerial port;
+  char name[64];
+  int slave;
+
+  CHECK(openpty(&master, &slave, name, 0, 0) == 0);
+  std::thread(broker).detach();
+  CHECK(port.begin(name));
+
+  PtyClient client(port);
+  SIM90XMQTT mqtt(client);
+  mqtt.setKeepAlive(KEEPALIVE_S);
+
+  // CONNECT/CONNACK
+  CHECK(mqtt.connect("broker", 1883, "test"));
+  CHECK(keepalive == KEEPALIVE_S);
+
+  // released by its PUBACK
+  CHECK(mqtt.publish("t", "a", 1));
+  run(mqtt, 1000, [&] { return mqtt.inflight() == 0; });
+  CHECK(mqtt.inflight() == 0);
+
+  // not acknowledged until the DUP retransmit
+  CHECK(mqtt.publish("t", "b", 1));
+  CHECK(mqtt.inflight() == 1);
+  run(mqtt, SIM90X_MQTT_RETRY_MS + 2000, [&] { return mqtt.inflight() == 0; });
+  CHECK(mqtt.inflight() == 0);
+
+  std::vector<packet> pub = packets(SIM90X_MQTT_PUBLISH);
+  CHECK(pub.size() == 3);
+  CHECK(! (pub[1].header & 0x08) && (pub[2].header & 0x08));
+  CHECK(pub[1].id == pub[2].id && pub[0].id != pub[1].id);
+  CHECK(pub[2].at - pub[1].at >= SIM90X_MQTT_RETRY_MS - 10);
+  CHECK(pub[2].at - pub[1].at < SIM90X_MQTT_RETRY_MS + 200);
+
+  // while idle, a PINGREQ every keepalive period
+  std::vector<packet> ping = packets(SIM90X_MQTT_PINGREQ);
+  CHECK(ping.size() >= 5);
+  for (size_t i=1; i<ping.size(); i++) {
+    CHECK(ping[i].at - ping[i-1].at >= KEEPALIVE_S * 1000UL - 10);
+    CHECK(ping[i].at - ping[i-1].at < KEEPALIVE_S * 1000UL + 200);
+  }
+
+  // a PINGREQ without PINGRESP for a keepalive period drops the session
+  answerpings = false;
+  size_t answered = ping.size();
+  run(mqtt, 3 * KEEPALIVE_S * 1000UL, [&] { return ! mqtt.connected(); });
+  unsigned long lost = millis();
+  CHECK(! mqtt.connected());
+  ping = packets(SIM90X_MQTT_PINGREQ);
+  CHECK(ping.size() > answered);
+  CHECK(lost - ping.back().at >= KEEPALIVE_S * 1000UL - 10);
+  CHECK(lost - ping.back().at < KEEPALIVE_S * 1000UL + 200);
+
+  puts("mqtt ok");
+  return 0;
+}
@@ -0,0 +1,112 @@
+/***************************************************
+  Tone sequences against a scripted modem on a pty pair.
+
+  Queues toolkit tones and a pause, drives them from poll() and checks
+  that the modem sees each AT+STTONE at its scheduled offset, then that
+  sendDTMF() puts a whole digit string in one AT+VTS.
+
+  BSD license, all text above must be included in any redistribution
+ ****************************************************/
+#include <pty.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PosixSerial.h"
+#include "SIM90X.h"
+
+struct command {
+  std::string line;
+  unsigned long at;
+};
+
+static int master;
+static std::mutex lock;
+static std::vector<command> seen;
+
+static void say(const char *s) {
+  if (write(master, s, strlen(s)) < 0) perror("write");
+}
+
+// Answer every command line with OK, log the tone and DTMF ones
+static void modem(void) {
+  char line[256];
+  size_t n = 0;
+  char c;
+
+  while (read(master, &c, 1) == 1) {
+    if (c != '\r') {
+      if (c != '\n' && n < sizeof(line)-1) line[n++] = c;
+      continue;
+    }
+    line[n] = 0;
+    n = 0;
+    if (! line[0]) continue;
+
+    if (strncmp(line, "AT+STTONE=", 10) == 0 || strncmp(line, "AT+VTS=", 7) == 0) {
+      std::lock_guard<std::mutex> guard(lock);
+      seen.push_back({ line, millis() });
+    }
+    say("\r\nOK\r\n");
+  }
+}
+
+static std::vector<command> commands(void) {
+  std::lock_guard<std::mutex> guard(lock);
+  return seen;
+}
+
+#define CHECK(x) do { if (! (x)) { fprintf(stderr, "FAIL %s:%d %s\n", __FILE__, __LINE__, #x); return 1; } } while (0)
+
+// how late a command may reach the modem
+#define SLACK_MS 50
+
+int main(void) {
+  static PosixSerial port;
+  static SIM90X gsm;
+  char name[64];
+  int slave;
+
+  CHECK(openpty(&master, &slave, name, 0, 0) == 0);
+  std::thread(modem).detach();
+  CHECK(port.begin(name));
+  CHECK(gsm.begin(port));
+
+  // tone 1, a pause, tone 2, tone 3 back to back
+  CHECK(gsm.queueTone(1, 300));
+  CHECK(gsm.queueTone(0, 200));
+  CHECK(gsm.queueTone(2, 300));
+  CHECK(gsm.queueTone(3, 100));
+  CHECK(gsm.queuedTones() == 4);
+
+  unsigned long start = millis();
+  while (millis() - start < 1500) {
+    gsm.poll();
+    delay(1);
+  }
+  CHECK(gsm.queuedTones() == 0);
+
+  std::vector<command> tones = commands();
+  CHECK(tones.size() == 3);
+  CHECK(tones[0].line == "AT+STTONE=1,1,300");
+  CHECK(tones[1].line == "AT+STTONE=1,2,300");
+  CHECK(tones[2].line == "AT+STTONE=1,3,100");
+
+  // offsets from the first tone, so the gaps don't add up round trips
+  const unsigned long due[] = { 0, 500, 800 };
+  for (size_t i=1; i<tones.size(); i++) {
+    unsigned long offset = tones[i].at - tones[0].at;
+    CHECK(offset + SLACK_MS >= due[i] && offset <= due[i] + SLACK_MS);
+  }
+
+  // a digit string goes to the remote party as one command
+  CHECK(gsm.sendDTMF("12#", 2));
+  std::vector<command> all = commands();
+  CHECK(all.size() == 4);
+  CHECK(all[3].line == "AT+VTS=\"1,2,#\",2");
+
+  puts("tone ok");
+  return 0;
+}